@@ -0,0 +1,198 @@
+#include "csapp.h"
+#include "accesslog.h"
+
+#define LOG_RING 1024           //records per ring, a power of 2
+#define LOG_BATCH 1638          //records per write, about 64K
+#define LOG_FLUSH 100           //ms between drains
+
+/* the ring of one producer thread */
+typedef struct log_ring {
+    unsigned long head __attribute__((aligned(64)));    //next to drain
+    unsigned long tail __attribute__((aligned(64)));    //next to fill
+    log_record recs[LOG_RING];
+    struct log_ring *next;      //list of all rings, never shrinks
+    struct log_ring *next_free; //rings of threads that exited
+} log_ring;
+
+static int log_fd = -1;
+static log_ring *rings;         //every ring ever made
+static log_ring *free_rings;    //rings no thread produces into
+static sem_t rings_mutex;       //protects free_rings and adding to rings
+static pthread_key_t ring_key;
+static __thread log_ring *self_ring;
+static unsigned long dropped;
+static log_record *drain_batch; //LOG_BATCH records written at once
+static sem_t drain_mutex;
+
+/* give the ring of an exiting thread to the next thread that logs */
+static void ring_release(void *vargp) {
+    log_ring *r = (log_ring *)vargp;
+
+    P(&rings_mutex);
+    r->next_free = free_rings;
+    free_rings = r;
+    V(&rings_mutex);
+}
+
+/*
+ * return the ring of the calling thread, NULL if out of memory
+ * a ring only ever has one producer, a reused ring changes hands under
+ * rings_mutex
+ */
+static log_ring *ring_self(void) {
+    log_ring *r;
+
+    if (self_ring != NULL) {
+        return self_ring;
+    }
+
+    P(&rings_mutex);
+    if ((r = free_rings) != NULL) {
+        free_rings = r->next_free;
+    }
+    else if ((r = calloc(1, sizeof(log_ring))) != NULL) {
+        r->next = rings;
+        __atomic_store_n(&rings, r, __ATOMIC_RELEASE);
+    }
+    V(&rings_mutex);
+
+    if (r != NULL) {
+        self_ring = r;
+        pthread_setspecific(ring_key, r);
+    }
+    return r;
+}
+
+/* write len bytes of buf to the log, giving up on errors */
+static void log_flush(char *buf, size_t len) {
+    if (len > 0 && rio_writen(log_fd, buf, len) < 0) {
+        fprintf(stderr, "accesslog: write error: %s\n", strerror(errno));
+    }
+}
+
+/*
+ * drain every ring into large writes of batch, LOG_BATCH records
+ * the writer and accesslog_flush() take turns under drain_mutex
+ */
+static void log_drain(log_record *batch) {
+    log_ring *r;
+    size_t n = 0;
+
+    for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+        unsigned long head = r->head;
+        unsigned long tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+        while (head != tail) {
+            batch[n++] = r->recs[head++ & (LOG_RING - 1)];
+            if (n == LOG_BATCH) {
+                __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+                log_flush((char *)batch, n * sizeof(log_record));
+                n = 0;
+            }
+        }
+        __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+    }
+    log_flush((char *)batch, n * sizeof(log_record));
+}
+
+/* writer thread: drain the rings every LOG_FLUSH ms */
+static void *log_writer(void *vargp) {
+    unsigned long reported = 0;
+
+    Pthread_detach(pthread_self());
+
+    while (1) {
+        usleep(LOG_FLUSH * 1000);
+
+        P(&drain_mutex);
+        log_drain(drain_batch);
+        V(&drain_mutex);
+
+        if (dropped != reported) {
+            reported = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+            fprintf(stderr, "accesslog: %lu records dropped\n", reported);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * a forked child has none of the threads the rings belonged to, nor the
+ * writer; it starts over with rings of its own appending to the same file
+ */
+static void log_atfork_child(void) {
+    pthread_t tid;
+
+    rings = NULL;
+    free_rings = NULL;
+    self_ring = NULL;
+    dropped = 0;
+    Sem_init(&rings_mutex, 0, 1);
+    Sem_init(&drain_mutex, 0, 1);
+    Pthread_create(&tid, NULL, log_writer, NULL);
+}
+
+/* open the log file and start the writer */
+int accesslog_open(char *path) {
+    pthread_t tid;
+    struct stat st;
+
+    if ((log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0) {
+        return -1;
+    }
+    if (fstat(log_fd, &st) == 0 && st.st_size == 0) {
+        rio_writen(log_fd, LOG_MAGIC, 8);
+    }
+    if ((drain_batch = malloc(LOG_BATCH * sizeof(log_record))) == NULL) {
+        close(log_fd);
+        log_fd = -1;
+        return -1;
+    }
+
+    Sem_init(&rings_mutex, 0, 1);
+    Sem_init(&drain_mutex, 0, 1);
+    pthread_key_create(&ring_key, ring_release);
+    pthread_atfork(NULL, NULL, log_atfork_child);
+    Pthread_create(&tid, NULL, log_writer, NULL);
+    return 0;
+}
+
+/* append a record to the calling thread's ring */
+void accesslog_write(log_record *rec) {
+    log_ring *r;
+    unsigned long tail;
+
+    if (log_fd < 0) {
+        return;
+    }
+    if ((r = ring_self()) == NULL) {
+        __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    tail = r->tail;
+    if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == LOG_RING) {
+        __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    r->recs[tail & (LOG_RING - 1)] = *rec;
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* write the records logged so far now, rather than at the next drain */
+void accesslog_flush(void) {
+    if (log_fd < 0) {
+        return;
+    }
+    P(&drain_mutex);
+    log_drain(drain_batch);
+    V(&drain_mutex);
+}
+
+/* wall clock time in microseconds */
+uint64_t accesslog_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
@@ -0,0 +1,62 @@
+#ifndef __ACCESSLOG_H__
+#define __ACCESSLOG_H__
+
+#include <stdint.h>
+
+/*
+ * binary access log
+ *
+ * Every finished request is one fixed size record. A thread logging a
+ * request appends the record to its own single producer, single
+ * consumer ring without any lock or system call; a writer thread
+ * drains all rings every LOG_FLUSH ms and appends what it collected to
+ * the log file in large writes. A record that finds its ring full is
+ * dropped and counted rather than blocking the request.
+ *
+ * Processes forked after the log is opened append to the same file,
+ * each through rings and a writer of its own.
+ *
+ * The file starts with LOG_MAGIC followed by the records in host byte
+ * order; logdump decodes it to text.
+ */
+
+#define LOG_MAGIC "PXLOG\0\0\1"         //8 bytes, version 1
+
+/* where the response came from */
+#define LOG_NONE 0              //the request never got to the cache
+#define LOG_HIT 1
+#define LOG_MISS 2
+#define LOG_TUNNEL 3
+#define LOG_PEER 4              //a miss relayed from the peer owning it
+
+/* one request, 40 bytes */
+typedef struct {
+    uint64_t time;              //wall clock start in microseconds
+    uint64_t uri_hash;          //fnv1a_hash() of the request URI
+    uint64_t bytes;             //response bytes sent to the client
+    uint32_t client;            //IPv4 address, network byte order
+    uint32_t latency;           //microseconds from start to finish
+    uint16_t status;            //HTTP status sent, 0 if none
+    uint8_t source;             //LOG_HIT, LOG_MISS, ...
+    uint8_t pad[5];
+} log_record;
+
+/*
+ * append records to the log file at path and start the writer thread
+ * return -1 if the file cannot be opened
+ */
+int accesslog_open(char *path);
+
+/* log a finished request, a no-op unless the log is open */
+void accesslog_write(log_record *rec);
+
+/*
+ * write every record logged so far before returning, for a process
+ * about to exit; a no-op unless the log is open
+ */
+void accesslog_flush(void);
+
+/* wall clock time in microseconds, the clock of log_record.time */
+uint64_t accesslog_now(void);
+
+#endif
@@ -0,0 +1,632 @@
+/*
+ * bench - benchmarks for the proxy
+ *
+ * bench http [-c conns] [-n requests] [-p pid] <proxy port> <url>
+ *     fetch url through the proxy on localhost, requests times over
+ *     conns concurrent connections, and report throughput and latency;
+ *     with the pid of the proxy, also report its read/write system
+ *     calls and CPU time per request from /proc, and ask it with
+ *     SIGUSR1 to print its io_uring_enter() count (-e uring); /proc
+ *     counts read and write like calls only, not accept(), close(),
+ *     setsockopt() or the clone() of a thread per connection
+ *
+ * Run the proxy once with -e thread and once with -e uring to compare
+ * the two I/O engines. The first request is a warm-up that puts url
+ * into the cache and is not counted. A url too large for the cache
+ * is a miss every time; run the proxy with different -b and -n to see
+ * what socket buffers and TCP_CORK do to relaying it, the syscalls per
+ * request show the read sizes.
+ *
+ * bench queue [-p producers] [-c consumers] [-n items] [-s slots]
+ *     pass items pointers from producer to consumer threads through a
+ *     queue of slots slots and report items per second, for a ring
+ *     guarded by a semaphore mutex (the sbuf of CS:APP 12.5), for the
+ *     sbuf the proxy hands connections over with, whose items go
+ *     through the lock-free mpmc_t of csapp, and for mpmc_t alone with
+ *     threads spinning on a full or empty queue
+ *
+ * bench hit [-t threads] [-n hits] [-o objects] [-s size] [-z] [-c] [-H pages]
+ *     serve hits of objects cached responses of size bytes the way the
+ *     proxy does, a cache_match() pinning the object, one writev of it
+ *     to /dev/null and a cache_release(), from threads threads, and
+ *     report hits per second, hits per CPU second (per core) and the
+ *     heap allocations made per hit, counted by interposing malloc();
+ *     with -z the objects are cached compressed and decoded on each hit,
+ *     with -c they are copied into a buffer instead of written, as a
+ *     send() copies them into the socket, so that a hit reads every
+ *     byte; with -H 4k, thp or hugetlb they live in a cache_arena() of
+ *     such pages and the huge pages the process ended up with are shown
+ *
+ * Compare -H 4k against -H thp with many objects, say -o 20000 -s 64000
+ * for a cache of over 2GB: every lookup walks the URIs of the cache, and
+ * a hit with -c reads its object, across pages that 4K pages need many
+ * more TLB entries for.
+ */
+
+#include "csapp.h"
+#include "sbuf.h"
+#include "cache.h"
+#include "bufpool.h"
+
+/* a run of the http benchmark */
+static char *bench_url;
+static int bench_port;
+static long bench_total;
+static long bench_next;         //index of the next request to make
+static long bench_bytes;
+static long bench_errors;
+static double *bench_lat;       //latency of each request in ms
+
+/* wall clock time in ms */
+static double now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* fetch bench_url once, return the bytes received or -1 */
+static long fetch(void) {
+    char buf[MAXBUF];
+    long bytes = 0;
+    ssize_t n;
+    int fd;
+
+    if ((fd = open_clientfd_r("localhost", bench_port)) < 0) {
+        return -1;
+    }
+    n = snprintf(buf, MAXBUF, "GET %s HTTP/1.0\r\n\r\n", bench_url);
+    if (rio_writen(fd, buf, n) < 0) {
+        close(fd);
+        return -1;
+    }
+    while ((n = read(fd, buf, MAXBUF)) > 0) {
+        bytes += n;
+    }
+    close(fd);
+    return (n < 0 || bytes == 0) ? -1 : bytes;
+}
+
+/* client thread: make requests until bench_total are done */
+static void *client(void *vargp) {
+    long i;
+
+    while ((i = __atomic_fetch_add(&bench_next, 1, __ATOMIC_RELAXED)) < bench_total) {
+        double start = now_ms();
+        long bytes = fetch();
+
+        bench_lat[i] = now_ms() - start;
+        if (bytes < 0) {
+            __atomic_fetch_add(&bench_errors, 1, __ATOMIC_RELAXED);
+        }
+        else {
+            __atomic_fetch_add(&bench_bytes, bytes, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+/* counters of a process read from /proc */
+typedef struct {
+    long syscr, syscw;          //read and write like system calls
+    long ticks;                 //user and system CPU time in clock ticks
+} proc_stat;
+
+/* read the counters of process pid, return -1 if it cannot be read */
+static int read_proc(int pid, proc_stat *ps) {
+    char path[64], line[MAXLINE], *p;
+    FILE *fp;
+    long utime, stime;
+    int i;
+
+    sprintf(path, "/proc/%d/io", pid);
+    if ((fp = fopen(path, "r")) == NULL) {
+        return -1;
+    }
+    while (fgets(line, MAXLINE, fp) != NULL) {
+        sscanf(line, "syscr: %ld", &ps->syscr);
+        sscanf(line, "syscw: %ld", &ps->syscw);
+    }
+    fclose(fp);
+
+    /* utime and stime are fields 14 and 15, after the ")" of comm */
+    sprintf(path, "/proc/%d/stat", pid);
+    if ((fp = fopen(path, "r")) == NULL) {
+        return -1;
+    }
+    p = fgets(line, MAXLINE, fp);
+    fclose(fp);
+    if (p == NULL || (p = strrchr(line, ')')) == NULL) {
+        return -1;
+    }
+    for (i = 0; i < 12 && p != NULL; i++) {
+        p = strchr(p + 1, ' ');
+    }
+    if (p == NULL || sscanf(p, "%ld %ld", &utime, &stime) != 2) {
+        return -1;
+    }
+    ps->ticks = utime + stime;
+    return 0;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(double *)a, y = *(double *)b;
+    return (x > y) - (x < y);
+}
+
+/* the http benchmark */
+static int bench_http(int argc, char **argv) {
+    int opt, conns = 16, pid = 0, i;
+    long done;
+    pthread_t *tids;
+    proc_stat before, after;
+    double start, secs;
+
+    bench_total = 10000;
+    while ((opt = getopt(argc, argv, "c:n:p:")) != -1) {
+        if (opt == 'c') {
+            conns = atoi(optarg);
+        }
+        else if (opt == 'n') {
+            bench_total = atol(optarg);
+        }
+        else if (opt == 'p') {
+            pid = atoi(optarg);
+        }
+        else {
+            return -1;
+        }
+    }
+    if (argc - optind != 2 || conns <= 0 || bench_total <= 0) {
+        return -1;
+    }
+    bench_port = atoi(argv[optind]);
+    bench_url = argv[optind + 1];
+
+    if (fetch() < 0) {
+        fprintf(stderr, "bench: cannot fetch %s through port %d\n",
+            bench_url, bench_port);
+        exit(1);
+    }
+
+    bench_lat = calloc(bench_total, sizeof(double));
+    tids = malloc(conns * sizeof(pthread_t));
+    if (pid && read_proc(pid, &before) < 0) {
+        fprintf(stderr, "bench: cannot read /proc/%d\n", pid);
+        pid = 0;
+    }
+
+    start = now_ms();
+    for (i = 0; i < conns; i++) {
+        Pthread_create(&tids[i], NULL, client, NULL);
+    }
+    for (i = 0; i < conns; i++) {
+        Pthread_join(tids[i], NULL);
+    }
+    secs = (now_ms() - start) / 1e3;
+
+    done = bench_total - bench_errors;
+    qsort(bench_lat, bench_total, sizeof(double), cmp_double);
+    printf("requests     %ld (%ld failed) over %d connections\n",
+        bench_total, bench_errors, conns);
+    printf("throughput   %.0f requests/s, %.1f MB/s\n",
+        done / secs, bench_bytes / secs / 1e6);
+    printf("latency      mean %.3f ms, p50 %.3f ms, p99 %.3f ms\n",
+        secs * 1e3 * conns / bench_total, bench_lat[bench_total / 2],
+        bench_lat[bench_total * 99 / 100]);
+
+    if (pid && read_proc(pid, &after) == 0 && done > 0) {
+        printf("proxy        %.2f read + %.2f write syscalls/request, "
+            "%.1f us CPU/request\n",
+            (double)(after.syscr - before.syscr) / done,
+            (double)(after.syscw - before.syscw) / done,
+            (after.ticks - before.ticks) * 1e6 / sysconf(_SC_CLK_TCK) / done);
+        kill(pid, SIGUSR1);
+    }
+    return 0;
+}
+
+/* a ring guarded by a semaphore mutex, as sbuf was before mpmc_t */
+typedef struct {
+    void **buf;
+    int n, front, rear;
+    sem_t mutex, slots, items;
+} semq_t;
+
+/* a run of the queue benchmark */
+static semq_t queue_semq;
+static sbuf_t queue_sbuf;
+static mpmc_t queue_mpmc;
+static long queue_total;        //items to pass
+static long queue_next;         //items producers have claimed to put
+static long queue_taken;        //items consumers have claimed to get
+static long queue_sum;          //of the items got, to check the queue
+
+static void semq_put(void *item) {
+    P(&queue_semq.slots);
+    P(&queue_semq.mutex);
+    queue_semq.buf[(++queue_semq.rear) % queue_semq.n] = item;
+    V(&queue_semq.mutex);
+    V(&queue_semq.items);
+}
+
+static void *semq_get(void) {
+    void *item;
+
+    P(&queue_semq.items);
+    P(&queue_semq.mutex);
+    item = queue_semq.buf[(++queue_semq.front) % queue_semq.n];
+    V(&queue_semq.mutex);
+    V(&queue_semq.slots);
+    return item;
+}
+
+static void sbuf_put(void *item) {
+    sbuf_insert(&queue_sbuf, item);
+}
+
+static void *sbuf_get(void) {
+    return sbuf_remove(&queue_sbuf);
+}
+
+static void mpmc_put(void *item) {
+    while (mpmc_push(&queue_mpmc, item) < 0) {
+        sched_yield();
+    }
+}
+
+static void *mpmc_get(void) {
+    void *item;
+
+    while (mpmc_pop(&queue_mpmc, &item) < 0) {
+        sched_yield();
+    }
+    return item;
+}
+
+/* the queue being benchmarked */
+static void (*queue_put)(void *item);
+static void *(*queue_get)(void);
+
+/* producer thread: put items 1, 2, ... until queue_total are claimed */
+static void *producer(void *vargp) {
+    long i;
+
+    while ((i = __atomic_fetch_add(&queue_next, 1, __ATOMIC_RELAXED)) < queue_total) {
+        queue_put((void *)(i + 1));
+    }
+    return NULL;
+}
+
+/* consumer thread: get items until queue_total are claimed */
+static void *consumer(void *vargp) {
+    long sum = 0;
+
+    while (__atomic_fetch_add(&queue_taken, 1, __ATOMIC_RELAXED) < queue_total) {
+        sum += (long)queue_get();
+    }
+    __atomic_fetch_add(&queue_sum, sum, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/* pass queue_total items through put and get, print one row */
+static void queue_run(char *name, int producers, int consumers,
+    void (*put)(void *item), void *(*get)(void)) {
+
+    pthread_t *tids = malloc((producers + consumers) * sizeof(pthread_t));
+    double start, secs;
+    int i;
+
+    queue_put = put;
+    queue_get = get;
+    queue_next = queue_taken = queue_sum = 0;
+
+    start = now_ms();
+    for (i = 0; i < producers + consumers; i++) {
+        Pthread_create(&tids[i], NULL, i < producers ? producer : consumer, NULL);
+    }
+    for (i = 0; i < producers + consumers; i++) {
+        Pthread_join(tids[i], NULL);
+    }
+    secs = (now_ms() - start) / 1e3;
+
+    printf("%-10s %12.0f items/s %8.1f ns/item  %s\n", name,
+        queue_total / secs, secs * 1e9 / queue_total,
+        queue_sum == queue_total * (queue_total + 1) / 2 ? "ok" : "LOST ITEMS");
+    free(tids);
+}
+
+/* the queue benchmark */
+static int bench_queue(int argc, char **argv) {
+    int opt, producers = 4, consumers = 4, slots = 1024;
+    size_t size = 2;
+
+    queue_total = 1000000;
+    while ((opt = getopt(argc, argv, "p:c:n:s:")) != -1) {
+        if (opt == 'p') {
+            producers = atoi(optarg);
+        }
+        else if (opt == 'c') {
+            consumers = atoi(optarg);
+        }
+        else if (opt == 'n') {
+            queue_total = atol(optarg);
+        }
+        else if (opt == 's') {
+            slots = atoi(optarg);
+        }
+        else {
+            return -1;
+        }
+    }
+    if (argc != optind || producers <= 0 || consumers <= 0 ||
+        queue_total <= 0 || slots <= 0) {
+        return -1;
+    }
+
+    printf("%ld items, %d producers, %d consumers, %d slots\n",
+        queue_total, producers, consumers, slots);
+
+    queue_semq.buf = Calloc(slots, sizeof(void *));
+    queue_semq.n = slots;
+    queue_semq.front = queue_semq.rear = 0;
+    Sem_init(&queue_semq.mutex, 0, 1);
+    Sem_init(&queue_semq.slots, 0, slots);
+    Sem_init(&queue_semq.items, 0, 0);
+    queue_run("semaphore", producers, consumers, semq_put, semq_get);
+
+    sbuf_init(&queue_sbuf, slots);
+    queue_run("sbuf", producers, consumers, sbuf_put, sbuf_get);
+
+    while (size < slots) {
+        size <<= 1;
+    }
+    if (mpmc_init(&queue_mpmc, size) < 0) {
+        unix_error("mpmc_init error");
+    }
+    queue_run("mpmc", producers, consumers, mpmc_put, mpmc_get);
+    return 0;
+}
+
+/* a run of the hit benchmark */
+static cache *hit_cache;
+static int hit_objects;
+static long hit_total;          //hits per thread
+static long hit_allocs;         //heap allocations of every thread's hits
+static int hit_devnull;
+static int hit_copy;            //copy objects instead of writing them
+
+/* heap allocations of the calling thread while it counts them */
+static __thread int alloc_counting;
+static __thread long alloc_count;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) {
+    alloc_count += alloc_counting;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    alloc_count += alloc_counting;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    alloc_count += alloc_counting;
+    return __libc_realloc(ptr, size);
+}
+
+/* serve hits hits the way serveGet() does, return -1 on a miss */
+static int hit_serve(long hits, unsigned seed, char *copy) {
+    char uri[64], age[HTTP_AGE_WIDTH], *decoded, *object;
+    cache_block hit, *block;
+    struct iovec iov[3];
+    size_t size;
+    long i;
+    int n, j;
+
+    for (i = 0; i < hits; i++) {
+        sprintf(uri, "http://bench/%d", (int)(rand_r(&seed) % hit_objects));
+        if ((block = cache_match(hit_cache, uri, &hit)) == NULL) {
+            return -1;
+        }
+        decoded = NULL;
+        if (block->compressed) {
+            decoded = buf_get(MAX_OBJECT_SIZE);
+        }
+        if ((object = cache_object(block, decoded, &size)) != NULL) {
+            n = cache_response(block, object, size, iov, age);
+            if (copy != NULL) {
+                for (j = 0, size = 0; j < n; j++) {
+                    memcpy(copy + size, iov[j].iov_base, iov[j].iov_len);
+                    size += iov[j].iov_len;
+                }
+            }
+            else {
+                rio_writevn(hit_devnull, iov, n);
+            }
+        }
+        buf_put(decoded);
+        cache_release(block);
+    }
+    return 0;
+}
+
+/* hit thread: warm up uncounted, then count the allocations of hit_total */
+static void *hitter(void *vargp) {
+    unsigned seed = (unsigned)(long)vargp;
+    char *copy = hit_copy ? buf_get(MAX_OBJECT_SIZE) : NULL;
+    int rc;
+
+    hit_serve(1000, seed, copy);
+    alloc_counting = 1;
+    rc = hit_serve(hit_total, seed, copy);
+    alloc_counting = 0;
+    buf_put(copy);
+    if (rc < 0) {
+        app_error("bench: cached object missing");
+    }
+    __atomic_fetch_add(&hit_allocs, alloc_count, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/* print the huge pages backing the process from /proc */
+static void hit_hugepages(void) {
+    char line[MAXLINE];
+    long kb;
+    FILE *fp;
+
+    if ((fp = fopen("/proc/self/smaps_rollup", "r")) == NULL) {
+        return;
+    }
+    while (fgets(line, MAXLINE, fp) != NULL) {
+        if (sscanf(line, "AnonHugePages: %ld", &kb) == 1) {
+            printf("huge pages   %ld MB transparent\n", kb >> 10);
+        }
+    }
+    fclose(fp);
+    if ((fp = fopen("/proc/meminfo", "r")) == NULL) {
+        return;
+    }
+    while (fgets(line, MAXLINE, fp) != NULL) {
+        long total, free;
+
+        if (sscanf(line, "HugePages_Total: %ld", &total) == 1 &&
+            fgets(line, MAXLINE, fp) != NULL &&
+            sscanf(line, "HugePages_Free: %ld", &free) == 1 && total > 0) {
+            printf("huge pages   %ld of %ld hugetlb pages in use\n",
+                total - free, total);
+        }
+    }
+    fclose(fp);
+}
+
+/* the hit benchmark */
+static int bench_hit(int argc, char **argv) {
+    int opt, threads = 1, compress = 0, pages = -1, i;
+    long size = 4096, n;
+    char uri[64], *object;
+    struct timespec cpu0, cpu1;
+    pthread_t *tids;
+    double start, secs, cpu;
+
+    hit_total = 1000000;
+    hit_objects = 64;
+    hit_copy = 0;
+    while ((opt = getopt(argc, argv, "t:n:o:s:zcH:")) != -1) {
+        if (opt == 't') {
+            threads = atoi(optarg);
+        }
+        else if (opt == 'n') {
+            hit_total = atol(optarg);
+        }
+        else if (opt == 'o') {
+            hit_objects = atoi(optarg);
+        }
+        else if (opt == 's') {
+            size = atol(optarg);
+        }
+        else if (opt == 'z') {
+            compress = 1;
+        }
+        else if (opt == 'c') {
+            hit_copy = 1;
+        }
+        else if (opt == 'H') {
+            if ((pages = cache_pages_parse(optarg)) < 0) {
+                return -1;
+            }
+        }
+        else {
+            return -1;
+        }
+    }
+    if (argc != optind || threads <= 0 || hit_total <= 0 ||
+        hit_objects <= 0 || size < 128 || size > MAX_OBJECT_SIZE) {
+        return -1;
+    }
+
+    /* text responses, all of them fitting in the cache */
+    hit_cache = cache_init();
+    hit_cache->budget = (long)hit_objects * (size + 1024) * 2;
+    hit_cache->compress = compress;
+    if (pages >= 0 && cache_arena(hit_cache, pages) < 0) {
+        unix_error("cache_arena error");
+    }
+    object = Malloc(size);
+    n = sprintf(object, "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n"
+        "Content-Length: %ld\r\n\r\n", size);
+    n += sprintf(object + n, "%ld", size - n);
+    for (; n < size; n++) {
+        object[n] = "the quick brown fox jumps over the lazy dog\n"[n % 44];
+    }
+    for (i = 0; i < hit_objects; i++) {
+        sprintf(uri, "http://bench/%d", i);
+        cache_insert_response(hit_cache, uri, object, size);
+    }
+    free(object);
+    hit_devnull = Open("/dev/null", O_WRONLY, 0);
+
+    printf("%ld hits per thread, %d threads, %d objects of %ld bytes%s\n",
+        hit_total, threads, hit_objects, size, compress ? ", compressed" : "");
+
+    tids = Malloc(threads * sizeof(pthread_t));
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu0);
+    start = now_ms();
+    for (i = 0; i < threads; i++) {
+        Pthread_create(&tids[i], NULL, hitter, (void *)(long)(i + 1));
+    }
+    for (i = 0; i < threads; i++) {
+        Pthread_join(tids[i], NULL);
+    }
+    secs = (now_ms() - start) / 1e3;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu1);
+    cpu = (cpu1.tv_sec - cpu0.tv_sec) + (cpu1.tv_nsec - cpu0.tv_nsec) / 1e9;
+
+    n = hit_total * threads;
+    printf("throughput   %.0f hits/s, %.0f hits per CPU second\n",
+        n / secs, n / cpu);
+    printf("allocations  %.4f per hit (%ld in %ld hits)\n",
+        (double)hit_allocs / n, hit_allocs, n);
+    if (pages >= 0) {
+        hit_hugepages();
+        cache_stats(hit_cache, stdout);
+    }
+    free(tids);
+    Close(hit_devnull);
+    cache_deinit(hit_cache);
+    return 0;
+}
+
+static void usage(char *prog) {
+    fprintf(stderr, "usage: %s http [-c conns] [-n requests] [-p pid] <proxy port> <url>\n", prog);
+    fprintf(stderr, "       %s queue [-p producers] [-c consumers] [-n items] [-s slots]\n", prog);
+    fprintf(stderr, "       %s hit [-t threads] [-n hits] [-o objects] [-s size] [-z] [-c] [-H pages]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int rc = -1;
+
+    if (argc < 2) {
+        usage(argv[0]);
+    }
+
+    /* the benchmark's own options follow its name */
+    if (!strcmp(argv[1], "http")) {
+        rc = bench_http(argc - 1, argv + 1);
+    }
+    else if (!strcmp(argv[1], "queue")) {
+        rc = bench_queue(argc - 1, argv + 1);
+    }
+    else if (!strcmp(argv[1], "hit")) {
+        rc = bench_hit(argc - 1, argv + 1);
+    }
+    if (rc < 0) {
+        usage(argv[0]);
+    }
+    return 0;
+}
@@ -0,0 +1,153 @@
+#include "csapp.h"
+#include "bufpool.h"
+
+#define BUF_CLASSES 9           //BUF_MIN << 0 up to BUF_MIN << 8 == BUF_MAX
+
+/* in front of every buffer */
+typedef struct buf_hdr {
+    struct buf_hdr *next;       //in a freelist
+    size_t size;                //usable bytes after the header
+} buf_hdr;
+
+/* freelists of the calling thread */
+static __thread buf_hdr *thread_free[BUF_CLASSES];
+static __thread int thread_count[BUF_CLASSES];
+static __thread int thread_registered;
+
+/* freelists shared by all threads */
+static buf_hdr *depot[BUF_CLASSES];
+static int depot_count[BUF_CLASSES];
+static sem_t depot_mutex;
+
+static pthread_once_t buf_once = PTHREAD_ONCE_INIT;
+static pthread_key_t buf_key;
+
+/* the class of size bytes, -1 if it is too large for the pool */
+static int buf_class(size_t size) {
+    int class = 0;
+
+    while (class < BUF_CLASSES && ((size_t)BUF_MIN << class) < size) {
+        class++;
+    }
+    return class < BUF_CLASSES ? class : -1;
+}
+
+/* put h into the depot, or free it if the depot is full */
+static void buf_deposit(int class, buf_hdr *h) {
+    P(&depot_mutex);
+    if (depot_count[class] < BUF_DEPOT_KEEP) {
+        h->next = depot[class];
+        depot[class] = h;
+        depot_count[class]++;
+        h = NULL;
+    }
+    V(&depot_mutex);
+    free(h);
+}
+
+/* a thread exits: hand its buffers to the depot */
+static void buf_thread_exit(void *vargp) {
+    int class;
+
+    for (class = 0; class < BUF_CLASSES; class++) {
+        while (thread_free[class] != NULL) {
+            buf_hdr *h = thread_free[class];
+            thread_free[class] = h->next;
+            buf_deposit(class, h);
+        }
+        thread_count[class] = 0;
+    }
+}
+
+static void buf_init(void) {
+    Sem_init(&depot_mutex, 0, 1);
+    pthread_key_create(&buf_key, buf_thread_exit);
+}
+
+/* return a buffer of at least size bytes */
+char *buf_get(size_t size) {
+    int class = buf_class(size);
+    buf_hdr *h = NULL;
+
+    if (class < 0) {
+        if ((h = malloc(sizeof(buf_hdr) + size)) == NULL) {
+            return NULL;
+        }
+        h->size = size;
+        return (char *)(h + 1);
+    }
+
+    if ((h = thread_free[class]) != NULL) {
+        thread_free[class] = h->next;
+        thread_count[class]--;
+        return (char *)(h + 1);
+    }
+
+    pthread_once(&buf_once, buf_init);
+    P(&depot_mutex);
+    if ((h = depot[class]) != NULL) {
+        depot[class] = h->next;
+        depot_count[class]--;
+    }
+    V(&depot_mutex);
+
+    if (h == NULL) {
+        if ((h = malloc(sizeof(buf_hdr) + ((size_t)BUF_MIN << class))) == NULL) {
+            return NULL;
+        }
+        h->size = (size_t)BUF_MIN << class;
+    }
+    return (char *)(h + 1);
+}
+
+/* make buf hold at least size bytes */
+char *buf_grow(char *buf, size_t size) {
+    char *bigger;
+
+    if (buf != NULL && buf_size(buf) >= size) {
+        return buf;
+    }
+    if ((bigger = buf_get(size)) == NULL) {
+        return NULL;
+    }
+    if (buf != NULL) {
+        memcpy(bigger, buf, buf_size(buf));
+        buf_put(buf);
+    }
+    return bigger;
+}
+
+/* give a buffer back */
+void buf_put(char *buf) {
+    buf_hdr *h;
+    int class;
+
+    if (buf == NULL) {
+        return;
+    }
+    h = (buf_hdr *)buf - 1;
+    if (h->size > BUF_MAX) {
+        free(h);
+        return;
+    }
+    class = buf_class(h->size);
+
+    if (!thread_registered) {
+        /* the key's destructor empties the freelists on thread exit */
+        pthread_once(&buf_once, buf_init);
+        pthread_setspecific(buf_key, (void *)1);
+        thread_registered = 1;
+    }
+    if (thread_count[class] < BUF_THREAD_KEEP) {
+        h->next = thread_free[class];
+        thread_free[class] = h;
+        thread_count[class]++;
+        return;
+    }
+    buf_deposit(class, h);
+}
+
+/* the usable bytes of buf */
+size_t buf_size(char *buf) {
+    return ((buf_hdr *)buf - 1)->size;
+}
@@ -0,0 +1,39 @@
+#ifndef __BUFPOOL_H__
+#define __BUFPOOL_H__
+
+#include <stddef.h>
+
+/*
+ * size classed pool of I/O buffers
+ *
+ * Buffers come in power of 2 classes from BUF_MIN to BUF_MAX bytes. A
+ * buffer given back goes to a freelist of the calling thread, so a
+ * thread serving one request after another keeps reusing the same few
+ * buffers without a lock; past BUF_THREAD_KEEP buffers of a class, and
+ * when the thread exits, they go to a depot shared by all threads, which
+ * keeps up to BUF_DEPOT_KEEP of a class and frees the rest. Larger
+ * buffers are malloc()ed and freed each time.
+ */
+
+#define BUF_MIN 512
+#define BUF_MAX (128 * 1024)
+#define BUF_THREAD_KEEP 8
+#define BUF_DEPOT_KEEP 256
+
+/* return a buffer of at least size bytes, NULL if out of memory */
+char *buf_get(size_t size);
+
+/*
+ * make buf hold at least size bytes, keeping its contents; buf may be
+ * NULL; return the buffer to use from now on, or NULL if out of memory,
+ * in which case buf is still valid
+ */
+char *buf_grow(char *buf, size_t size);
+
+/* give a buffer back, buf may be NULL */
+void buf_put(char *buf);
+
+/* the usable bytes of buf */
+size_t buf_size(char *buf);
+
+#endif
@@ -1,9 +1,120 @@
+#include <malloc.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
 #include "csapp.h"
 #include "cache.h"
+#include "bufpool.h"
+#include "compress.h"
+#include "http.h"
 
-#define MAX_CACHE_SIZE (1 << 20)
-#define MAX_OBJECT_SIZE 102400
+/* bytes malloc keeps in front of every chunk it hands out */
+#define CACHE_MALLOC_OVERHEAD sizeof(size_t)
 
+/*
+ * the object and uri of an entry, in one allocation that the list and
+ * every copy from cache_match() hold a reference to
+ */
+typedef struct {
+    long refs;
+    long size;                  //heap bytes, counted in pinned once dropped
+    cache *owner;               //NULL for a copy out of a shared cache
+    char data[];                //the object, then the uri
+} cache_payload;
+
+/* heap bytes behind a pointer from malloc */
+static size_t cache_heap(void *ptr) {
+    return malloc_usable_size(ptr) + CACHE_MALLOC_OVERHEAD;
+}
+
+static void *cache_arena_alloc(struct cache_arena *arena, size_t size);
+static void cache_arena_free(struct cache_arena *arena, void *ptr);
+static size_t cache_arena_heap(struct cache_arena *arena, void *ptr);
+static size_t cache_arena_chunk(size_t size);
+
+/* a payload of size bytes, from the arena if there is room left in it */
+static cache_payload *cache_payload_alloc(cache *cache_hdr, size_t size) {
+    cache_payload *payload = NULL;
+
+    if (cache_hdr->arena != NULL) {
+        payload = cache_arena_alloc(cache_hdr->arena, size);
+    }
+    return payload != NULL ? payload : malloc(size);
+}
+
+/* free a payload from cache_payload_alloc() */
+static void cache_payload_free(cache *cache_hdr, cache_payload *payload) {
+    if (cache_hdr->arena == NULL ||
+        cache_arena_heap(cache_hdr->arena, payload) == 0) {
+        free(payload);
+        return;
+    }
+    cache_arena_free(cache_hdr->arena, payload);
+}
+
+/* move a payload into size bytes, keeping it where it is if that fails */
+static cache_payload *cache_payload_shrink(cache *cache_hdr,
+    cache_payload *payload, size_t size) {
+    cache_payload *shrunk;
+
+    if (cache_hdr->arena == NULL ||
+        cache_arena_heap(cache_hdr->arena, payload) == 0) {
+        shrunk = realloc(payload, size);
+        return shrunk != NULL ? shrunk : payload;
+    }
+    if ((shrunk = cache_arena_alloc(cache_hdr->arena, size)) == NULL) {
+        return payload;
+    }
+    memcpy(shrunk, payload, size);
+    cache_payload_free(cache_hdr, payload);
+    return shrunk;
+}
+
+/* bytes behind a payload from cache_payload_alloc() */
+static size_t cache_payload_heap(cache *cache_hdr, cache_payload *payload) {
+    size_t size = 0;
+
+    if (cache_hdr->arena != NULL) {
+        size = cache_arena_heap(cache_hdr->arena, payload);
+    }
+    return size != 0 ? size : cache_heap(payload);
+}
+
+/* the payload an object lives in */
+static cache_payload *cache_payload_of(char *object) {
+    return (cache_payload *)(object - offsetof(cache_payload, data));
+}
+
+/*
+ * let go of a reference to the payload of object, the last one frees it
+ * the list drops its reference with the cache mutex held, the copies
+ * from cache_match() without
+ */
+static void cache_put(char *object, int drop) {
+    cache_payload *payload = cache_payload_of(object);
+    cache *cache_hdr = payload->owner;
+
+    if (cache_hdr == NULL) {
+        buf_put((char *)payload);
+        return;
+    }
+    if (drop) {
+        __atomic_fetch_add(&cache_hdr->pinned, payload->size, __ATOMIC_RELAXED);
+    }
+    if (__atomic_sub_fetch(&payload->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        __atomic_fetch_sub(&cache_hdr->pinned, payload->size, __ATOMIC_RELAXED);
+        cache_payload_free(cache_hdr, payload);
+    }
+}
+
+static cache_block *cache_shm_match(cache *cache_hdr, char *uri,
+    cache_block *hit);
+static void cache_shm_insert(cache *cache_hdr, cache_block *block);
+static void cache_shm_store(cache *cache_hdr, char *uri, char *object,
+    size_t size, size_t hdr_len, size_t age_at, long age);
+static void cache_shm_stats(cache *cache_hdr, FILE *out);
+static void cache_arena_destroy(cache *cache_hdr);
+static void cache_arena_stats(cache *cache_hdr, FILE *out);
 
 /* cache initiation */
 cache *cache_init() {
@@ -12,6 +123,19 @@ cache *cache_init() {
     temp->start = init_block;
     temp->end = init_block;
     temp->size = 0;
+    temp->raw_size = 0;
+    temp->used = 0;
+    temp->budget = MAX_CACHE_SIZE;
+    temp->pinned = 0;
+    temp->entries = 0;
+    temp->evictions = 0;
+    temp->policy = CACHE_LRU;
+    temp->shm = NULL;
+    temp->shm_fd = -1;
+    temp->arena = NULL;
+    temp->compress = 0;
+    temp->ttl = 0;
+    temp->stale = 0;
     sem_init(&(temp->mutex), 0, 1);
     return temp;
 }
@@ -19,11 +143,23 @@ cache *cache_init() {
 /* add the cache block to the end of the linked list */
 void cache_most_recent(cache *cache_hdr, cache_block *block) {
     cache_hdr->size += block->object_size;
+    cache_hdr->raw_size += block->raw_size;
+    cache_hdr->used += block->charge;
+    cache_hdr->entries++;
 
     /* put the block info into the old end block */
     cache_hdr->end->uri = block->uri;
     cache_hdr->end->object = block->object;
     cache_hdr->end->object_size = block->object_size;
+    cache_hdr->end->raw_size = block->raw_size;
+    cache_hdr->end->compressed = block->compressed;
+    cache_hdr->end->expires = block->expires;
+    cache_hdr->end->stale_until = block->stale_until;
+    cache_hdr->end->refresh_at = block->refresh_at;
+    cache_hdr->end->charge = block->charge;
+    cache_hdr->end->hdr_len = block->hdr_len;
+    cache_hdr->end->age_at = block->age_at;
+    cache_hdr->end->born = block->born;
 
     /* use the old block as the end block */
     cache_hdr->end->next = block;
@@ -35,38 +171,83 @@ void cache_most_recent(cache *cache_hdr, cache_block *block) {
 void cache_evict(cache *cache_hdr) {
     cache_block *start = cache_hdr->start;
     cache_hdr->size -= start->object_size;
+    cache_hdr->raw_size -= start->raw_size;
+    cache_hdr->used -= start->charge;
+    cache_hdr->entries--;
+    cache_hdr->evictions++;
 
     cache_hdr->start = cache_hdr->start->next;
+    cache_put(start->object, 1);
     free(start);
 
     return;
 }
 
-/* delete a cache block from the cache */
-void cache_delete(cache *cache_hdr, cache_block *block) {
+/* free a cache and every object in it */
+void cache_deinit(cache *cache_hdr) {
+    while (cache_hdr->start != cache_hdr->end) {
+        cache_evict(cache_hdr);
+    }
+    free(cache_hdr->end);
+    cache_arena_destroy(cache_hdr);
+    sem_destroy(&(cache_hdr->mutex));
+    free(cache_hdr);
+}
+
+/*
+ * unlink a cache block from the cache, the caller keeps the reference
+ * the list had to its payload; return the list node it frees up
+ */
+static cache_block *cache_unlink(cache *cache_hdr, cache_block *block) {
+    cache_block *next = block->next;
+
     cache_hdr->size -= block->object_size;
+    cache_hdr->raw_size -= block->raw_size;
+    cache_hdr->used -= block->charge;
+    cache_hdr->entries--;
 
-    if (cache_hdr->start->next == cache_hdr->end) {
-        /* if the cache contains only one block */
-        cache_hdr->end = cache_hdr->start;
-    }
-    else {
-        /* the node is in the middle */
-        block->uri = block->next->uri;
-        block->object_size = block->next->object_size;
-        block->object = block->next->object;
-        free(block->next);
-        block->next = block->next->next;
+    /* pull the next node into this one and free the next node,
+     * if the next node is the dummy end this node becomes the end */
+    block->uri = next->uri;
+    block->object_size = next->object_size;
+    block->raw_size = next->raw_size;
+    block->compressed = next->compressed;
+    block->expires = next->expires;
+    block->stale_until = next->stale_until;
+    block->refresh_at = next->refresh_at;
+    block->charge = next->charge;
+    block->hdr_len = next->hdr_len;
+    block->age_at = next->age_at;
+    block->born = next->born;
+    block->object = next->object;
+    block->next = next->next;
+    if (next == cache_hdr->end) {
+        cache_hdr->end = block;
     }
-    return;
+    return next;
+}
+
+/*
+ * unlink a cache block from the cache, the caller keeps the reference
+ * the list had to its payload
+ */
+void cache_delete(cache *cache_hdr, cache_block *block) {
+    free(cache_unlink(cache_hdr, block));
 }
 
 /*
  * look for the cache block with given uri in the cache pointed by cache_hdr
- * return the pointer to the block if cache hit
+ * return hit holding a copy of the block if cache hit, the caller
+ * releases it
  * return NULL otherwise
  */
-cache_block *cache_match(cache *cache_hdr, char *uri) {
+cache_block *cache_match(cache *cache_hdr, char *uri, cache_block *hit) {
+    long now = rio_clock();
+
+    if (cache_hdr->shm != NULL) {
+        return cache_shm_match(cache_hdr, uri, hit);
+    }
+
     /* using mutex and semaphors to prevent race conditions */
     P(&(cache_hdr->mutex));
 
@@ -75,18 +256,39 @@ cache_block *cache_match(cache *cache_hdr, char *uri) {
     for (ptr = cache_hdr->start; ptr != cache_hdr->end; ptr = ptr->next) {
         /* go through each node in the linked list */
         if (!strcmp(uri, ptr->uri)) {
-            /* object matches - save the node info into a temp block */
-            cache_block *temp = malloc(sizeof(cache_block));
-            temp->uri = ptr->uri;
-            temp->object_size = ptr->object_size;
-            temp->object = ptr->object;
-            temp->next = ptr->next;
-
-            /* update the matched block as most recently used */
-            cache_delete(cache_hdr, ptr);
-            cache_most_recent(cache_hdr, temp);
+            /* too stale to serve, the caller fetches it as a miss */
+            if (ptr->expires && now >= ptr->stale_until) {
+                break;
+            }
+
+            /* a single caller gets to refresh an expired object */
+            int freshness = CACHE_FRESH;
+            if (ptr->expires && now >= ptr->expires) {
+                freshness = CACHE_STALE;
+                if (!ptr->refresh_at ||
+                    now - ptr->refresh_at >= CACHE_REFRESH_RETRY) {
+                    freshness = CACHE_REFRESH;
+                    ptr->refresh_at = now;
+                }
+            }
+
+            /* the caller gets its own copy, list nodes are reused, and
+             * a reference that keeps the payload until it is released */
+            *hit = *ptr;
+            hit->freshness = freshness;
+            __atomic_fetch_add(&cache_payload_of(ptr->object)->refs, 1,
+                __ATOMIC_RELAXED);
+
+            if (cache_hdr->policy == CACHE_LRU) {
+                /* object matches - move the node info to the end, into
+                 * the list node unlinking it frees up */
+                cache_block temp = *ptr;
+                cache_block *spare = cache_unlink(cache_hdr, ptr);
+                *spare = temp;
+                cache_most_recent(cache_hdr, spare);
+            }
             V(&(cache_hdr->mutex));
-            return temp;
+            return hit;
         }     
     }
 
@@ -96,36 +298,1051 @@ cache_block *cache_match(cache *cache_hdr, char *uri) {
     return NULL;
 }
 
-/* insert an object to cache */
-void cache_insert(cache *cache_hdr, char *uri, char *object, size_t size) {
+/* let go of the object of a block filled in by cache_match() */
+void cache_release(cache_block *block) {
+    cache_put(block->object, 0);
+}
+
+/*
+ * return 1 if the object is a response worth compressing:
+ * a text-like Content-Type and no Content-Encoding, so bodies that are
+ * already gzipped by the server are stored and served as they are
+ */
+static int cache_compressible(char *object, size_t size) {
+    char value[MAXLINE];
+    size_t hdr_len = http_header_len(object, size);
+
+    if (hdr_len == 0) {
+        return 0;
+    }
+    if (http_get_header(object, hdr_len, "Content-Encoding", value, MAXLINE) &&
+        strcasecmp(value, "identity")) {
+        return 0;
+    }
+    if (!http_get_header(object, hdr_len, "Content-Type", value, MAXLINE)) {
+        return 0;
+    }
+    return (!strncasecmp(value, "text/", 5) ||
+        strcasestr(value, "javascript") != NULL ||
+        strcasestr(value, "json") != NULL ||
+        strcasestr(value, "xml") != NULL);
+}
+
+/* parse the number after name= in a Cache-Control value, -1 if absent */
+static long cache_directive(char *value, char *name) {
+    size_t len = strlen(name);
+    char *p = value;
+
+    while ((p = strcasestr(p, name)) != NULL) {
+        if ((p == value || p[-1] == ' ' || p[-1] == ',') && p[len] == '=') {
+            return atol(p + len + 1);
+        }
+        p += len;
+    }
+    return -1;
+}
+
+/* set the expiry times of a block holding object from now on */
+static void cache_lifetime(cache *cache_hdr, cache_block *block,
+    char *object, size_t size) {
+
+    char value[MAXLINE];
+    size_t hdr_len = http_header_len(object, size);
+    long now = rio_clock(), stale = cache_hdr->stale, secs;
+
+    block->expires = cache_hdr->ttl ? now + cache_hdr->ttl : 0;
+    if (hdr_len &&
+        http_get_header(object, hdr_len, "Cache-Control", value, MAXLINE)) {
+        if ((secs = cache_directive(value, "s-maxage")) >= 0 ||
+            (secs = cache_directive(value, "max-age")) >= 0) {
+            block->expires = now + secs * 1000;
+        }
+        if ((secs = cache_directive(value, "stale-while-revalidate")) >= 0) {
+            stale = secs * 1000;
+        }
+    }
+    block->stale_until = block->expires + stale;
+    block->refresh_at = 0;
+}
+
+/*
+ * count bytes against the budget of a private cache ahead of an insert,
+ * evicting blocks to make room for them
+ * return -1 if they exceed the whole budget
+ */
+static int cache_reserve(cache *cache_hdr, size_t bytes) {
+    if (bytes > cache_hdr->budget) {
+        return -1;
+    }
     P(&(cache_hdr->mutex));
+    while (bytes + cache_hdr->used > cache_hdr->budget &&
+        cache_hdr->start != cache_hdr->end) {
+        cache_evict(cache_hdr);
+    }
+    cache_hdr->used += bytes;
+    V(&(cache_hdr->mutex));
+    return 0;
+}
+
+/* give back bytes from cache_reserve() */
+static void cache_unreserve(cache *cache_hdr, size_t bytes) {
+    P(&(cache_hdr->mutex));
+    cache_hdr->used -= bytes;
+    V(&(cache_hdr->mutex));
+}
+
+/*
+ * insert an object to cache, whose first hdr_len bytes are a header
+ * with its Age value at age_at if it came from cache_insert_response()
+ */
+static void cache_store(cache *cache_hdr, char *uri, char *object,
+    size_t size, size_t hdr_len, size_t age_at, long age) {
 
     /* do not insert objects exceed the max size */
     if (size > MAX_OBJECT_SIZE) {
         return;
     }
 
-    /* if the cache is full, evict blocks until the object can be fitted in */
-    while (size + cache_hdr->size > MAX_CACHE_SIZE) {
-        cache_evict(cache_hdr);
+    /* a shared cache copies the object straight into its segment */
+    if (cache_hdr->shm != NULL) {
+        cache_shm_store(cache_hdr, uri, object, size, hdr_len, age_at, age);
+        return;
+    }
+
+    size_t uri_len = strlen(uri) + 1;
+    size_t need = sizeof(cache_payload) + size + uri_len, reserve = 0;
+    cache_payload *payload;
+    size_t stored_size = 0;
+    int compressed = 0;
+
+    /* the list node is taken first, its bytes go into the reservation */
+    cache_block *temp = malloc(sizeof(cache_block));
+    if (temp == NULL) {
+        return;
     }
 
-    /* copy object */
-    char *obj_copy = malloc(size);
-    memcpy(obj_copy, object, size);
+    /* the arena is only as large as the budget, so evict for the payload
+     * before carving it; evicting after would find a full region and put
+     * every new object of a full cache on the heap */
+    if (cache_hdr->arena != NULL) {
+        reserve = cache_arena_chunk(need) + cache_heap(temp);
+        if (cache_reserve(cache_hdr, reserve) < 0) {
+            free(temp);
+            return;
+        }
+    }
+
+    /* compress outside the lock, keep the result only if it saves space;
+     * the object and its uri go into a single payload */
+    if ((payload = cache_payload_alloc(cache_hdr, need)) == NULL) {
+        if (reserve != 0) {
+            cache_unreserve(cache_hdr, reserve);
+        }
+        free(temp);
+        return;
+    }
+    if (cache_hdr->compress && cache_compressible(object, size)) {
+        stored_size = lz_compress(object, size, payload->data, size - size / 8);
+        compressed = (stored_size > 0);
+    }
+    if (!compressed) {
+        /* copy object */
+        memcpy(payload->data, object, size);
+        stored_size = size;
+    }
 
     /* copy uri */
-    char *uri_copy = malloc(strlen(uri));
-    memcpy(uri_copy, uri, strlen(uri));
+    memcpy(payload->data + stored_size, uri, uri_len);
+    if (compressed) {
+        payload = cache_payload_shrink(cache_hdr, payload,
+            sizeof(cache_payload) + stored_size + uri_len);
+    }
+    payload->refs = 1;
+    payload->size = cache_payload_heap(cache_hdr, payload);
+    payload->owner = cache_hdr;
+
+    /* fill in the new block, it becomes the dummy end of the list */
+    temp->uri = payload->data + stored_size;
+    temp->object_size = stored_size;
+    temp->raw_size = size;
+    temp->compressed = compressed;
+    temp->object = payload->data;
+    temp->charge = payload->size + cache_heap(temp);
+    temp->hdr_len = hdr_len;
+    temp->age_at = age_at;
+    cache_lifetime(cache_hdr, temp, object, size);
+    temp->born = rio_clock() - age * 1000;
+
+    P(&(cache_hdr->mutex));
+    cache_hdr->used -= reserve;
+
+    /* swap out the object it replaces, callers holding a copy of that
+     * block keep serving it */
+    cache_block *ptr = cache_hdr->start;
+    while (ptr != cache_hdr->end) {
+        if (!strcmp(uri, ptr->uri)) {
+            /* the next node is pulled into ptr */
+            char *old = ptr->object;
+            cache_delete(cache_hdr, ptr);
+            cache_put(old, 1);
+        }
+        else {
+            ptr = ptr->next;
+        }
+    }
+
+    /* an entry larger than the whole budget is not cached at all */
+    if (temp->charge > cache_hdr->budget) {
+        V(&(cache_hdr->mutex));
+        cache_payload_free(cache_hdr, payload);
+        free(temp);
+        return;
+    }
+
+    /* if the cache is full, evict blocks until the entry can be fitted in;
+     * bytes other inserts reserved may keep it over budget until those
+     * come in and evict */
+    while (temp->charge + cache_hdr->used > cache_hdr->budget &&
+        cache_hdr->start != cache_hdr->end) {
+        cache_evict(cache_hdr);
+    }
 
-    /* create a new block and add into the cache */
-    cache_block *temp = malloc(sizeof(cache_block));
-    temp->uri = uri_copy;
-    temp->object_size = size;
-    temp->object = obj_copy;
     /* update the new block as most recently used */
     cache_most_recent(cache_hdr, temp);
 
     V(&(cache_hdr->mutex));
     return;
 }
+
+/* insert an object to cache */
+void cache_insert(cache *cache_hdr, char *uri, char *object, size_t size) {
+    cache_store(cache_hdr, uri, object, size, 0, 0, 0);
+}
+
+/* insert a response to cache with a header ready to serve */
+void cache_insert_response(cache *cache_hdr, char *uri, char *response,
+    size_t size) {
+
+    size_t hdr_len = http_header_len(response, size), len, age_at;
+    char *object;
+    long age;
+
+    if (hdr_len == 0 || size > MAX_OBJECT_SIZE ||
+        (object = buf_get(size + HTTP_CACHE_EXTRA)) == NULL) {
+        cache_insert(cache_hdr, uri, response, size);
+        return;
+    }
+    len = http_cache_header(response, hdr_len, object, &age_at, &age);
+    if (len == 0 || len + size - hdr_len > MAX_OBJECT_SIZE) {
+        cache_insert(cache_hdr, uri, response, size);
+    }
+    else {
+        memcpy(object + len, response + hdr_len, size - hdr_len);
+        cache_store(cache_hdr, uri, object, len + size - hdr_len, len,
+            age_at, age);
+    }
+    buf_put(object);
+}
+
+/* the iovecs to send a hit from */
+int cache_response(cache_block *block, char *object, size_t size,
+    struct iovec *iov, char *age) {
+
+    long secs = (rio_clock() - block->born) / 1000;
+    int i = HTTP_AGE_WIDTH;
+
+    iov[0].iov_base = object;
+    iov[0].iov_len = size;
+    if (block->hdr_len == 0 || block->age_at + HTTP_AGE_WIDTH > size) {
+        return 1;
+    }
+
+    /* the digits of secs, then blanks up to the width of the value */
+    if (secs < 0) {
+        secs = 0;
+    }
+    do {
+        age[--i] = '0' + secs % 10;
+        secs /= 10;
+    } while (secs > 0 && i > 0);
+    memmove(age, age + i, HTTP_AGE_WIDTH - i);
+    memset(age + HTTP_AGE_WIDTH - i, ' ', i);
+
+    iov[0].iov_len = block->age_at;
+    iov[1].iov_base = age;
+    iov[1].iov_len = HTTP_AGE_WIDTH;
+    iov[2].iov_base = object + block->age_at + HTTP_AGE_WIDTH;
+    iov[2].iov_len = size - block->age_at - HTTP_AGE_WIDTH;
+    return 3;
+}
+
+/* return the servable bytes of a cached object */
+char *cache_object(cache_block *block, char *buf, size_t *size) {
+    if (!block->compressed) {
+        *size = block->object_size;
+        return block->object;
+    }
+
+    *size = lz_decompress(block->object, block->object_size,
+        buf, MAX_OBJECT_SIZE);
+    if (*size != block->raw_size) {
+        return NULL;
+    }
+    return buf;
+}
+
+/* print where the bytes of the cache go to out */
+void cache_stats(cache *cache_hdr, FILE *out) {
+    long used, pinned, evictions;
+    int entries, size, raw_size;
+
+    if (cache_hdr->shm != NULL) {
+        cache_shm_stats(cache_hdr, out);
+        return;
+    }
+
+    P(&(cache_hdr->mutex));
+    used = cache_hdr->used;
+    entries = cache_hdr->entries;
+    size = cache_hdr->size;
+    raw_size = cache_hdr->raw_size;
+    evictions = cache_hdr->evictions;
+    V(&(cache_hdr->mutex));
+    pinned = __atomic_load_n(&cache_hdr->pinned, __ATOMIC_RELAXED);
+
+    fprintf(out, "cache: %d entries, %ld of %ld bytes used (%.1f%%)\n",
+        entries, used, cache_hdr->budget,
+        cache_hdr->budget ? 100.0 * used / cache_hdr->budget : 0.0);
+    fprintf(out, "cache: %d payload bytes (%d served), %ld overhead bytes "
+        "(%.1f%%) for uris, list nodes and malloc\n", size, raw_size,
+        used - size, used ? 100.0 * (used - size) / used : 0.0);
+    fprintf(out, "cache: %ld evictions, %ld bytes dropped but still being served\n",
+        evictions, pinned);
+    cache_arena_stats(cache_hdr, out);
+}
+
+
+/* ------------------ cache in shared memory ------------------ */
+
+#define SHM_ALIGN 128           //entry alignment, at least sizeof(shm_entry)
+#define SHM_BUCKET_BYTES 4096   //budget per hash bucket
+#define SHM_MAGIC 0x70726f7879636801UL  //"proxyc" and a layout version, bump
+                                        //it when shm_entry or cache_shm change
+
+/*
+ * an entry in the arena, followed by its uri and object
+ * entries are written at the head of the arena, a ring, and dropped at
+ * its tail; an entry that would not fit before the end of the arena is
+ * written at its start and the rest of the arena is padding
+ */
+typedef struct {
+    uint64_t len;               //bytes up to the next entry, a multiple of SHM_ALIGN
+    uint64_t pos;               //ring position of the entry
+    uint64_t next;              //offset of the next entry in its bucket, or 0
+    uint64_t hash;
+    uint64_t object_size, raw_size;
+    int64_t expires, stale_until, refresh_at, born;
+    uint64_t hdr_len, age_at;
+    uint32_t uri_len;           //including the '\0'
+    int32_t live;               //0 for padding and replaced entries
+    int32_t compressed;
+} shm_entry;
+
+/* the start of the segment; everything in it is found by offset */
+typedef struct cache_shm {
+    uint64_t magic;             //SHM_MAGIC, checked by cache_attach()
+    pthread_mutex_t lock;       //process shared and robust
+    uint64_t buckets;           //offset of the bucket array
+    uint64_t nbuckets;          //a power of 2
+    uint64_t arena;             //offset of the arena
+    uint64_t arena_size;        //a multiple of SHM_ALIGN
+    uint64_t head, tail;        //ring positions, head - tail bytes in use
+    int64_t entries, size, raw_size, evictions, resets;
+} cache_shm;
+
+#define SHM_AT(shm, off) ((char *)(shm) + (off))
+
+/* the bucket of hash */
+static uint64_t *cache_shm_bucket(cache_shm *shm, uint64_t hash) {
+    return (uint64_t *)SHM_AT(shm, shm->buckets) + (hash & (shm->nbuckets - 1));
+}
+
+/* empty the cache */
+static void cache_shm_reset(cache_shm *shm) {
+    memset(SHM_AT(shm, shm->buckets), 0, shm->nbuckets * sizeof(uint64_t));
+    /* the tail only moves forward, see cache_shm_match() */
+    __atomic_store_n(&shm->tail, shm->head, __ATOMIC_RELEASE);
+    shm->entries = shm->size = shm->raw_size = 0;
+}
+
+/*
+ * lock the segment; if a worker died holding the lock the cache may be
+ * half updated and is emptied
+ */
+static void cache_shm_lock(cache_shm *shm) {
+    if (pthread_mutex_lock(&shm->lock) == EOWNERDEAD) {
+        cache_shm_reset(shm);
+        shm->resets++;
+        pthread_mutex_consistent(&shm->lock);
+    }
+}
+
+/* take a live entry out of its bucket */
+static void cache_shm_unlink(cache_shm *shm, shm_entry *e) {
+    uint64_t *link = cache_shm_bucket(shm, e->hash);
+    uint64_t off = (char *)e - (char *)shm;
+
+    while (*link != off) {
+        link = &((shm_entry *)SHM_AT(shm, *link))->next;
+    }
+    *link = e->next;
+    e->live = 0;
+    shm->entries--;
+    shm->size -= e->object_size;
+    shm->raw_size -= e->raw_size;
+}
+
+/*
+ * drop the entry at the tail of the ring
+ * a reader copying an entry checks afterwards that the tail did not pass
+ * it, the fence orders the new tail before the bytes written over it
+ */
+static void cache_shm_evict(cache_shm *shm) {
+    shm_entry *e = (shm_entry *)SHM_AT(shm,
+        shm->arena + shm->tail % shm->arena_size);
+
+    if (e->live) {
+        cache_shm_unlink(shm, e);
+        shm->evictions++;
+    }
+    __atomic_store_n(&shm->tail, shm->tail + e->len, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/*
+ * put a cache in a POSIX shared memory segment of about budget bytes;
+ * processes forked afterwards share it, the descriptor of the segment
+ * is kept to hand it to a new image, see cache_attach()
+ * return -1 if the segment cannot be made
+ */
+int cache_share(cache *cache_hdr) {
+    char name[64];
+    long nbuckets = 256, arena_off, size;
+    pthread_mutexattr_t attr;
+    cache_shm *shm;
+    int fd;
+
+    while (nbuckets * SHM_BUCKET_BYTES < cache_hdr->budget) {
+        nbuckets *= 2;
+    }
+    arena_off = sizeof(cache_shm) + nbuckets * sizeof(uint64_t);
+    arena_off = (arena_off + SHM_ALIGN - 1) / SHM_ALIGN * SHM_ALIGN;
+    size = cache_hdr->budget / SHM_ALIGN * SHM_ALIGN;
+    if (size <= arena_off + SHM_ALIGN) {
+        return -1;
+    }
+
+    /* the name is gone once mapped, the segment lives as long as a mapping */
+    sprintf(name, "/proxy-cache-%d", getpid());
+    if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0) {
+        return -1;
+    }
+    shm_unlink(name);
+    if (ftruncate(fd, size) < 0 ||
+        (shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+            fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    /* a fresh segment reads as zeros */
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&shm->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    shm->buckets = sizeof(cache_shm);
+    shm->nbuckets = nbuckets;
+    shm->arena = arena_off;
+    shm->arena_size = size - arena_off;
+    shm->magic = SHM_MAGIC;
+
+    cache_hdr->shm = shm;
+    cache_hdr->shm_fd = fd;
+    return 0;
+}
+
+/*
+ * map the segment of a shared cache another image of the proxy made,
+ * handed over as descriptor fd
+ * its size and lock are the segment's own, and the entries in it are
+ * kept as long as its layout is the one of this build
+ * return -1 if fd is not such a segment
+ */
+int cache_attach(cache *cache_hdr, int fd) {
+    struct stat st;
+    cache_shm *shm;
+
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(cache_shm) ||
+        (shm = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+            fd, 0)) == MAP_FAILED) {
+        return -1;
+    }
+    if (shm->magic != SHM_MAGIC ||
+        shm->arena + shm->arena_size != (uint64_t)st.st_size) {
+        munmap(shm, st.st_size);
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    cache_hdr->budget = st.st_size;
+    cache_hdr->shm = shm;
+    cache_hdr->shm_fd = fd;
+    return 0;
+}
+
+/*
+ * look uri up and copy its entry into a private payload from the pool
+ * the copy is made outside the lock and thrown away if the entry was
+ * dropped while it was being copied
+ */
+static cache_block *cache_shm_match(cache *cache_hdr, char *uri,
+    cache_block *hit) {
+
+    cache_shm *shm = cache_hdr->shm;
+    uint64_t hash = fnv1a_hash(uri), off;
+    long now = rio_clock();
+    cache_payload *payload;
+    shm_entry *e = NULL, entry;
+
+    cache_shm_lock(shm);
+    for (off = *cache_shm_bucket(shm, hash); off != 0; off = e->next) {
+        e = (shm_entry *)SHM_AT(shm, off);
+        if (e->hash == hash && !strcmp(uri, (char *)(e + 1))) {
+            break;
+        }
+    }
+    if (off == 0 || (e->expires && now >= e->stale_until)) {
+        pthread_mutex_unlock(&shm->lock);
+        return NULL;
+    }
+    entry = *e;
+
+    /* a single caller of all processes gets to refresh an expired object */
+    hit->freshness = CACHE_FRESH;
+    if (e->expires && now >= e->expires) {
+        hit->freshness = CACHE_STALE;
+        if (!e->refresh_at || now - e->refresh_at >= CACHE_REFRESH_RETRY) {
+            hit->freshness = CACHE_REFRESH;
+            e->refresh_at = now;
+        }
+    }
+    pthread_mutex_unlock(&shm->lock);
+
+    payload = (cache_payload *)buf_get(sizeof(cache_payload) +
+        entry.object_size + entry.uri_len);
+    if (payload == NULL) {
+        return NULL;
+    }
+    memcpy(payload->data, (char *)(e + 1) + entry.uri_len, entry.object_size);
+    memcpy(payload->data + entry.object_size, uri, entry.uri_len);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&shm->tail, __ATOMIC_ACQUIRE) > entry.pos) {
+        /* overwritten while copying, a miss */
+        buf_put((char *)payload);
+        return NULL;
+    }
+
+    payload->refs = 1;
+    payload->size = buf_size((char *)payload);
+    payload->owner = NULL;
+    hit->next = NULL;
+    hit->object_size = entry.object_size;
+    hit->raw_size = entry.raw_size;
+    hit->compressed = entry.compressed;
+    hit->expires = entry.expires;
+    hit->stale_until = entry.stale_until;
+    hit->refresh_at = entry.refresh_at;
+    hit->charge = entry.len;
+    hit->hdr_len = entry.hdr_len;
+    hit->age_at = entry.age_at;
+    hit->born = entry.born;
+    hit->object = payload->data;
+    hit->uri = payload->data + entry.object_size;
+    return hit;
+}
+
+/*
+ * insert an object to a shared cache as cache_store() does, without a
+ * payload of its own: the object is copied into the segment as it is,
+ * or compressed into a pooled scratch buffer first
+ */
+static void cache_shm_store(cache *cache_hdr, char *uri, char *object,
+    size_t size, size_t hdr_len, size_t age_at, long age) {
+
+    cache_block block;
+    char *packed = NULL;
+
+    block.object = object;
+    block.object_size = size;
+    block.compressed = 0;
+    if (cache_hdr->compress && cache_compressible(object, size) &&
+        (packed = buf_get(size - size / 8)) != NULL &&
+        (block.object_size = lz_compress(object, size, packed,
+            size - size / 8)) > 0) {
+        block.object = packed;
+        block.compressed = 1;
+    }
+    else {
+        block.object_size = size;
+    }
+    block.uri = uri;
+    block.raw_size = size;
+    block.hdr_len = hdr_len;
+    block.age_at = age_at;
+    cache_lifetime(cache_hdr, &block, object, size);
+    block.born = rio_clock() - age * 1000;
+
+    cache_shm_insert(cache_hdr, &block);
+    buf_put(packed);
+}
+
+/* copy the entry of block into the arena, dropping the oldest entries */
+static void cache_shm_insert(cache *cache_hdr, cache_block *block) {
+    cache_shm *shm = cache_hdr->shm;
+    uint64_t uri_len = strlen(block->uri) + 1, hash = fnv1a_hash(block->uri);
+    uint64_t len = sizeof(shm_entry) + uri_len + block->object_size;
+    uint64_t pad, off, *bucket;
+    shm_entry *e;
+
+    /*
+     * with at most half the arena per entry, the padding before an entry
+     * and the entry always fit into an empty ring
+     */
+    len = (len + SHM_ALIGN - 1) / SHM_ALIGN * SHM_ALIGN;
+    if (len > shm->arena_size / 2) {
+        return;
+    }
+
+    cache_shm_lock(shm);
+
+    /* replace the entry of the same uri */
+    bucket = cache_shm_bucket(shm, hash);
+    for (off = *bucket; off != 0; off = e->next) {
+        e = (shm_entry *)SHM_AT(shm, off);
+        if (e->hash == hash && !strcmp(block->uri, (char *)(e + 1))) {
+            cache_shm_unlink(shm, e);
+            break;
+        }
+    }
+
+    /* an entry does not wrap around the end of the arena */
+    pad = shm->arena_size - shm->head % shm->arena_size;
+    if (pad >= len) {
+        pad = 0;
+    }
+    while (shm->arena_size - (shm->head - shm->tail) < pad + len) {
+        cache_shm_evict(shm);
+    }
+    if (pad) {
+        e = (shm_entry *)SHM_AT(shm, shm->arena + shm->head % shm->arena_size);
+        e->len = pad;
+        e->pos = shm->head;
+        e->live = 0;
+        shm->head += pad;
+    }
+
+    off = shm->arena + shm->head % shm->arena_size;
+    e = (shm_entry *)SHM_AT(shm, off);
+    e->len = len;
+    e->pos = shm->head;
+    e->hash = hash;
+    e->object_size = block->object_size;
+    e->raw_size = block->raw_size;
+    e->compressed = block->compressed;
+    e->expires = block->expires;
+    e->stale_until = block->stale_until;
+    e->refresh_at = 0;
+    e->hdr_len = block->hdr_len;
+    e->age_at = block->age_at;
+    e->born = block->born;
+    e->uri_len = uri_len;
+    e->live = 1;
+    memcpy(e + 1, block->uri, uri_len);
+    memcpy((char *)(e + 1) + uri_len, block->object, block->object_size);
+    e->next = *bucket;
+    *bucket = off;
+    shm->head += len;
+
+    shm->entries++;
+    shm->size += block->object_size;
+    shm->raw_size += block->raw_size;
+    pthread_mutex_unlock(&shm->lock);
+}
+
+/* print where the bytes of a shared cache go to out */
+static void cache_shm_stats(cache *cache_hdr, FILE *out) {
+    cache_shm *shm = cache_hdr->shm;
+    long used, entries, size, raw_size, evictions, resets, total;
+
+    cache_shm_lock(shm);
+    used = shm->head - shm->tail;
+    entries = shm->entries;
+    size = shm->size;
+    raw_size = shm->raw_size;
+    evictions = shm->evictions;
+    resets = shm->resets;
+    pthread_mutex_unlock(&shm->lock);
+    total = shm->arena + shm->arena_size;
+
+    fprintf(out, "cache: shared, %ld entries, %ld of %ld arena bytes in use "
+        "(%.1f%%), %ld bytes of index\n", entries, used, (long)shm->arena_size,
+        100.0 * used / shm->arena_size, (long)shm->arena);
+    fprintf(out, "cache: %ld payload bytes (%ld served), %ld overhead bytes "
+        "(%.1f%%) for uris, entry headers, padding and the index\n", size,
+        raw_size, used + (long)shm->arena - size,
+        100.0 * (used + shm->arena - size) / total);
+    fprintf(out, "cache: %ld evictions, %ld resets after a worker died "
+        "holding the lock\n", evictions, resets);
+}
+
+
+/* ------------------ cache arena ------------------ */
+
+#define ARENA_HUGE (2UL << 20)  //huge page size, alignment of the region
+
+/* region bytes beyond the budget, for objects still being served after
+ * eviction and for free space cut into chunks too small to reuse */
+#define ARENA_SLACK (4 * MAX_OBJECT_SIZE)
+
+#define ARENA_CLASSES 37        //chunk sizes from 320 to 128K+64 in quarter steps
+#define ARENA_MIN 320           //smallest chunk
+#define ARENA_FREE 1            //flags in the low bits of a chunk's size
+#define ARENA_PREV_FREE 2
+#define ARENA_FLAGS 3
+
+/*
+ * the chunk bytes of a class, 4/4 to 7/4 of a power of 2 and a cache
+ * line; chunks a power of 2 apart would have their headers and uris in
+ * the same few cache sets once huge pages make the region physically
+ * contiguous, and every lookup walks those uris
+ */
+#define ARENA_CLASS_SIZE(class) \
+    (((size_t)(4 + (class) % 4) << (6 + (class) / 4)) + 64)
+
+/*
+ * in front of every payload carved out of the region; a free chunk
+ * keeps its freelist links where its payload was, and the chunk after
+ * it knows its size, so chunks freed next to each other merge
+ */
+typedef struct arena_chunk {
+    size_t size;                //bytes of the chunk, header included, a
+                                //multiple of 64 or'ed with ARENA_FREE and
+                                //ARENA_PREV_FREE
+    size_t prev_size;           //bytes of the chunk before, if that is free
+    struct arena_chunk *next;   //in a freelist, while free
+    struct arena_chunk *prev;
+} arena_chunk;
+
+#define ARENA_HDR offsetof(arena_chunk, next)   //bytes in front of a payload
+#define ARENA_BYTES(chunk) ((chunk)->size & ~(size_t)ARENA_FLAGS)
+
+/*
+ * chunks are carved off the start of the region and split off free
+ * chunks that are larger; a freed chunk merges with free neighbours,
+ * or goes back to the region if it ends where carving stopped, and is
+ * put on the freelist of the largest class it fills, so any chunk on a
+ * list serves that class
+ * no two free chunks are neighbours, and none ends at top
+ */
+struct cache_arena {
+    char *base;                 //the region, ARENA_HUGE aligned
+    size_t size;
+    size_t top;                 //bytes carved off the region so far
+    void *map;                  //the mapping the region lies in
+    size_t map_len;
+    int pages;                  //CACHE_PAGES_*
+    long in_use;                //bytes of live chunks
+    long fallbacks;             //payloads malloc()ed for want of room
+    arena_chunk *free[ARENA_CLASSES];
+    sem_t mutex;
+};
+
+static char *arena_names[] = {"4k", "thp", "hugetlb"};
+static char *arena_pages[] = {"4K", "transparent huge", "hugetlb"};
+
+/* the smallest class of size bytes, -1 if there is none */
+static int arena_class(size_t size) {
+    int class = 0;
+
+    while (class < ARENA_CLASSES && ARENA_CLASS_SIZE(class) < size) {
+        class++;
+    }
+    return class < ARENA_CLASSES ? class : -1;
+}
+
+/* the largest class a chunk of size bytes fills, size >= ARENA_MIN */
+static int arena_fills(size_t size) {
+    int class = 0;
+
+    while (class + 1 < ARENA_CLASSES && ARENA_CLASS_SIZE(class + 1) <= size) {
+        class++;
+    }
+    return class;
+}
+
+/* the chunk after chunk, NULL if chunk ends at top */
+static arena_chunk *arena_after(struct cache_arena *arena, arena_chunk *chunk) {
+    char *after = (char *)chunk + ARENA_BYTES(chunk);
+
+    return after < arena->base + arena->top ? (arena_chunk *)after : NULL;
+}
+
+/* make size bytes at chunk a free chunk on its freelist, mutex held */
+static void arena_link(struct cache_arena *arena, arena_chunk *chunk,
+    size_t size) {
+
+    int class = arena_fills(size);
+    arena_chunk *after;
+
+    chunk->size = size | ARENA_FREE;
+    chunk->prev = NULL;
+    if ((chunk->next = arena->free[class]) != NULL) {
+        chunk->next->prev = chunk;
+    }
+    arena->free[class] = chunk;
+    if ((after = arena_after(arena, chunk)) != NULL) {
+        after->prev_size = size;
+        after->size |= ARENA_PREV_FREE;
+    }
+}
+
+/* take a free chunk off its freelist, mutex held */
+static void arena_unlink(struct cache_arena *arena, arena_chunk *chunk) {
+    arena_chunk *after = arena_after(arena, chunk);
+
+    if (chunk->prev != NULL) {
+        chunk->prev->next = chunk->next;
+    }
+    else {
+        arena->free[arena_fills(ARENA_BYTES(chunk))] = chunk->next;
+    }
+    if (chunk->next != NULL) {
+        chunk->next->prev = chunk->prev;
+    }
+    chunk->size &= ~(size_t)ARENA_FREE;
+    if (after != NULL) {
+        after->size &= ~(size_t)ARENA_PREV_FREE;
+    }
+}
+
+/* free a chunk, merging it with free neighbours, mutex held */
+static void arena_release(struct cache_arena *arena, arena_chunk *chunk) {
+    size_t size = ARENA_BYTES(chunk);
+    arena_chunk *after = arena_after(arena, chunk), *before;
+
+    if (after != NULL && (after->size & ARENA_FREE)) {
+        arena_unlink(arena, after);
+        size += ARENA_BYTES(after);
+    }
+    if (chunk->size & ARENA_PREV_FREE) {
+        before = (arena_chunk *)((char *)chunk - chunk->prev_size);
+        arena_unlink(arena, before);
+        size += ARENA_BYTES(before);
+        chunk = before;
+    }
+
+    if ((char *)chunk + size == arena->base + arena->top) {
+        arena->top -= size;
+        return;
+    }
+    arena_link(arena, chunk, size);
+}
+
+/* a chunk of class from a freelist or the region, NULL if none is left */
+static arena_chunk *arena_take(struct cache_arena *arena, int class) {
+    size_t size = ARENA_CLASS_SIZE(class), rest;
+    arena_chunk *chunk;
+    int i = class;
+
+    /* a freed chunk first, its pages are faulted in already, then the
+     * region, then a larger freed chunk split up */
+    if (arena->free[class] == NULL) {
+        if (arena->size - arena->top >= size) {
+            chunk = (arena_chunk *)(arena->base + arena->top);
+            chunk->size = size;
+            arena->top += size;
+            return chunk;
+        }
+        while (i < ARENA_CLASSES && arena->free[i] == NULL) {
+            i++;
+        }
+        if (i == ARENA_CLASSES) {
+            return NULL;
+        }
+    }
+
+    chunk = arena->free[i];
+    arena_unlink(arena, chunk);
+    if ((rest = ARENA_BYTES(chunk) - size) >= ARENA_MIN) {
+        /* the chunk after it is in use, the rest does not merge */
+        chunk->size = size;
+        arena_link(arena, (arena_chunk *)((char *)chunk + size), rest);
+    }
+    return chunk;
+}
+
+/* size bytes carved out of the arena, NULL if it has no room for them */
+static void *cache_arena_alloc(struct cache_arena *arena, size_t size) {
+    int class = arena_class(ARENA_HDR + size);
+    arena_chunk *chunk = NULL;
+
+    P(&arena->mutex);
+    if (class >= 0) {
+        chunk = arena_take(arena, class);
+    }
+    if (chunk != NULL) {
+        arena->in_use += ARENA_BYTES(chunk);
+    }
+    else {
+        arena->fallbacks++;
+    }
+    V(&arena->mutex);
+    return chunk != NULL ? (char *)chunk + ARENA_HDR : NULL;
+}
+
+/* give back bytes from cache_arena_alloc() */
+static void cache_arena_free(struct cache_arena *arena, void *ptr) {
+    arena_chunk *chunk = (arena_chunk *)((char *)ptr - ARENA_HDR);
+
+    P(&arena->mutex);
+    arena->in_use -= ARENA_BYTES(chunk);
+    arena_release(arena, chunk);
+    V(&arena->mutex);
+}
+
+/* bytes of the chunk behind ptr, 0 if ptr is not in the arena */
+static size_t cache_arena_heap(struct cache_arena *arena, void *ptr) {
+    if ((char *)ptr < arena->base || (char *)ptr >= arena->base + arena->size) {
+        return 0;
+    }
+    return ARENA_BYTES((arena_chunk *)((char *)ptr - ARENA_HDR));
+}
+
+/* bytes of the chunk a payload of size bytes takes, size if none fits it */
+static size_t cache_arena_chunk(size_t size) {
+    int class = arena_class(ARENA_HDR + size);
+
+    return class >= 0 ? ARENA_CLASS_SIZE(class) : size;
+}
+
+/* back the objects of an empty cache by a region of huge pages */
+int cache_arena(cache *cache_hdr, int pages) {
+    size_t size = (cache_hdr->budget + ARENA_SLACK + ARENA_HUGE - 1) &
+        ~(ARENA_HUGE - 1);
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+    struct cache_arena *arena;
+    size_t map_len = size;
+    char *map;
+
+    if (cache_hdr->shm != NULL) {
+        if (pages == CACHE_PAGES_HUGETLB) {
+            errno = EINVAL;
+            return -1;
+        }
+        return madvise(cache_hdr->shm,
+            cache_hdr->shm->arena + cache_hdr->shm->arena_size,
+            pages == CACHE_PAGES_THP ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+    }
+
+    if (pages == CACHE_PAGES_HUGETLB) {
+        /* huge pages come aligned, and reserved up front */
+        flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+    }
+    else {
+        /* room to align the region so that it can be huge pages throughout */
+        map_len += ARENA_HUGE;
+    }
+    if ((map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, flags, -1, 0)) ==
+        MAP_FAILED) {
+        return -1;
+    }
+    if ((arena = calloc(1, sizeof(struct cache_arena))) == NULL) {
+        munmap(map, map_len);
+        return -1;
+    }
+    arena->map = map;
+    arena->map_len = map_len;
+    arena->base = (char *)(((uintptr_t)map + ARENA_HUGE - 1) & ~(ARENA_HUGE - 1));
+    arena->size = size;
+    arena->pages = pages;
+    Sem_init(&arena->mutex, 0, 1);
+
+    /* pages are only faulted in as chunks are carved, huge ones with THP */
+    if (pages != CACHE_PAGES_HUGETLB) {
+        madvise(arena->base, size,
+            pages == CACHE_PAGES_THP ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+    }
+    cache_hdr->arena = arena;
+    return 0;
+}
+
+/* CACHE_PAGES_* named by spec */
+int cache_pages_parse(char *spec) {
+    int pages;
+
+    for (pages = CACHE_PAGES_NORMAL; pages <= CACHE_PAGES_HUGETLB; pages++) {
+        if (!strcasecmp(spec, arena_names[pages])) {
+            return pages;
+        }
+    }
+    return -1;
+}
+
+/* unmap the arena of a cache that has no objects left */
+static void cache_arena_destroy(cache *cache_hdr) {
+    struct cache_arena *arena = cache_hdr->arena;
+
+    if (arena == NULL) {
+        return;
+    }
+    munmap(arena->map, arena->map_len);
+    sem_destroy(&arena->mutex);
+    free(arena);
+    cache_hdr->arena = NULL;
+}
+
+/*
+ * print how full the arena is to out; with the region all carved, a
+ * largest free chunk well below the free bytes, and fallbacks growing,
+ * mean the free space is cut up too small for the objects coming in
+ */
+static void cache_arena_stats(cache *cache_hdr, FILE *out) {
+    struct cache_arena *arena = cache_hdr->arena;
+    long in_use, fallbacks, nfree = 0;
+    size_t top, free_bytes = 0, largest = 0;
+    arena_chunk *chunk;
+    int class;
+
+    if (arena == NULL) {
+        return;
+    }
+    P(&arena->mutex);
+    in_use = arena->in_use;
+    fallbacks = arena->fallbacks;
+    top = arena->top;
+    for (class = 0; class < ARENA_CLASSES; class++) {
+        for (chunk = arena->free[class]; chunk != NULL; chunk = chunk->next) {
+            free_bytes += ARENA_BYTES(chunk);
+            largest = ARENA_BYTES(chunk) > largest ? ARENA_BYTES(chunk) : largest;
+            nfree++;
+        }
+    }
+    V(&arena->mutex);
+
+    fprintf(out, "cache: arena of %zu bytes in %s pages, %zu carved, "
+        "%ld in use, %ld objects malloc()ed for want of room\n", arena->size,
+        arena_pages[arena->pages], top, in_use, fallbacks);
+    fprintf(out, "cache: arena has %zu bytes in %ld free chunks, the largest "
+        "%zu bytes\n", free_bytes, nfree, largest);
+}
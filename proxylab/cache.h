@@ -2,12 +2,45 @@
 #define __CACHE_H__
 
 #include "csapp.h"
+#include "http.h"
+
+/* Recommended max cache and object sizes, MAX_CACHE_SIZE is the default
+ * budget of all bytes the cache allocates */
+#define MAX_CACHE_SIZE (1 << 20)
+#define MAX_OBJECT_SIZE 102400
+
+/* ms before a stale object whose refresh never finished may be refreshed again */
+#define CACHE_REFRESH_RETRY 10000
+
+/* eviction policies */
+#define CACHE_LRU 0             //least recently used first
+#define CACHE_FIFO 1            //least recently inserted first
+
+/* pages backing the objects of a cache, see cache_arena() */
+#define CACHE_PAGES_NORMAL 0    //4K pages, transparent huge pages kept off
+#define CACHE_PAGES_THP 1       //transparent huge pages, madvise()d
+#define CACHE_PAGES_HUGETLB 2   //huge pages reserved with MAP_HUGETLB
+
+/* freshness of a block returned by cache_match() */
+#define CACHE_FRESH 0           //within its lifetime
+#define CACHE_STALE 1           //expired, another caller is refreshing it
+#define CACHE_REFRESH 2         //expired, this caller has to refresh it
 
 /* a cache line */
 typedef struct cache_block {
     struct cache_block *next;   //point to the next node in linked list
-    size_t object_size;         //size of the object in the block
-    char *uri;
+    size_t object_size;         //size of the object as stored (physical)
+    size_t raw_size;            //size of the object as served (logical)
+    int compressed;             //1 if object holds lz_compress() output
+    int freshness;              //CACHE_FRESH, ... in copies from cache_match()
+    long expires;               //rio_clock() time it turns stale, 0 if never
+    long stale_until;           //rio_clock() time it may no longer be served
+    long refresh_at;            //rio_clock() time a refresh was claimed, or 0
+    size_t charge;              //heap bytes of the entry counted against the budget
+    size_t hdr_len;             //bytes of a header ready to serve, 0 if none
+    size_t age_at;              //offset of the Age value in that header
+    long born;                  //rio_clock() time the object had Age 0
+    char *uri;                  //uri and object share one counted allocation
     char *object;
 }cache_block;
 
@@ -15,24 +48,123 @@ typedef struct cache_block {
 typedef struct cache {
     cache_block *start;     //point to the dummy head before the first block
     cache_block *end;       //point to the dummy end after the last block
-    int size;               //cache size used to check if cache is full
+    int size;               //physical bytes of the cached objects
+    int raw_size;           //logical bytes of the cached objects
+    long used;              //heap bytes of all entries, metadata included
+    long budget;            //bound of used, MAX_CACHE_SIZE by default
+    long pinned;            //bytes of dropped entries still being served
+    int entries;
+    long evictions;
+    int policy;             //CACHE_LRU or CACHE_FIFO
+    struct cache_shm *shm;  //segment of a shared cache, see cache_share()
+    int shm_fd;             //its descriptor, -1 for a private cache
+    struct cache_arena *arena;  //region objects are carved from, see cache_arena()
+    int compress;           //compress text-like objects on insert
+    long ttl;               //ms objects without max-age stay fresh, 0 for ever
+    long stale;             //ms expired objects are served while refreshed
     sem_t mutex;
 }cache;
 
 /* cache initiation */
 cache *cache_init();
 
+/*
+ * move an empty cache into a POSIX shared memory segment of its budget,
+ * before forking processes that are to share it; entries are found by
+ * offset inside the segment and written into it as a ring, so the oldest
+ * object is evicted first whatever the policy, and a hit is copied out;
+ * objects taking more than half the segment are not cached
+ * return -1 if the segment cannot be made
+ */
+int cache_share(cache *cache_hdr);
+
+/*
+ * share the segment of another image's shared cache instead, handed
+ * over as descriptor fd across an exec(), objects and all; the cache
+ * takes its budget from the segment
+ * return -1 if fd is not the segment of a cache of this build
+ */
+int cache_attach(cache *cache_hdr, int fd);
+
+/*
+ * carve the objects of an empty cache out of one mmap()ed region of its
+ * budget, plus some slack, backed by pages (CACHE_PAGES_*), instead of
+ * malloc()ing each, so hits across a large cache touch a few huge pages
+ * rather than 4K pages all over the heap; an insert evicts for its
+ * object before carving it, and an object the region still has no room
+ * for is malloc()ed as before and counted in cache_stats()
+ * a shared cache only has its segment madvise()d, CACHE_PAGES_HUGETLB
+ * is not supported for it
+ * return -1 if the region cannot be made
+ */
+int cache_arena(cache *cache_hdr, int pages);
+
+/* CACHE_PAGES_* named by spec, 4k, thp or hugetlb, -1 for anything else */
+int cache_pages_parse(char *spec);
+
+/*
+ * free a cache and every object in it, blocks returned by cache_match()
+ * must not be released after this
+ */
+void cache_deinit(cache *cache_hdr);
+
 /*
  * look for the cache block with given uri in the cache pointed by cache_hdr
- * return the pointer to the block if cache hit
- * return NULL otherwise
+ * return hit, filled in with a copy of the block, if cache hit; the
+ * object is pinned until the caller lets go of it with cache_release(),
+ * its uri and object stay valid until then; no memory is allocated
+ * except to copy an object out of a shared cache, from the buffer pool
+ * return NULL otherwise, or if the object expired more than its stale
+ * period ago
+ * an expired object is still returned while it may be served stale; the
+ * first caller to find it gets freshness CACHE_REFRESH and is expected
+ * to fetch the object again and cache_insert() it, the others get
+ * CACHE_STALE until the new object replaces it
  */
-cache_block *cache_match(cache *cache_hdr, char *uri);
+cache_block *cache_match(cache *cache_hdr, char *uri, cache_block *hit);
+
+/* unpin the object of a block filled in by cache_match() */
+void cache_release(cache_block *block);
 
 /*
- * insert an object to cache
- * eviction policy when cache is full: LRU (least recently used)
+ * insert an object to cache, replacing any object cached under uri
+ * eviction policy when cache is full: cache_hdr->policy, LRU by default
+ * the cache is full when the object, its uri, the list node and malloc's
+ * overhead for each would take used over budget
+ * if cache_hdr->compress is set, text-like objects are stored compressed
+ * the object stays fresh for the s-maxage or max-age of its
+ * Cache-Control header or else cache_hdr->ttl, and is served stale for
+ * its stale-while-revalidate or else cache_hdr->stale after that
  */
 void cache_insert(cache *cache_hdr, char *uri, char *object, size_t size);
 
+/*
+ * insert a response to cache as cache_insert() does, with its header
+ * rewritten by http_cache_header() once here rather than on every hit;
+ * a response that is not one, or too large once rewritten, is inserted
+ * as it is
+ */
+void cache_insert_response(cache *cache_hdr, char *uri, char *response,
+    size_t size);
+
+/*
+ * fill iov with the pieces to send a hit from, the size servable bytes
+ * of object from cache_object(); the Age value of a response inserted
+ * by cache_insert_response() goes into age (HTTP_AGE_WIDTH bytes), and
+ * the cached bytes around it are sent in place
+ * return the number of iovecs, at most 3
+ */
+int cache_response(cache_block *block, char *object, size_t size,
+    struct iovec *iov, char *age);
+
+/*
+ * return the servable bytes of a cached object and store their count
+ * in *size; compressed objects are decoded into buf (MAX_OBJECT_SIZE)
+ * return NULL if a compressed object cannot be decoded
+ */
+char *cache_object(cache_block *block, char *buf, size_t *size);
+
+/* print where the bytes of the cache go to out */
+void cache_stats(cache *cache_hdr, FILE *out);
+
 #endif
@@ -0,0 +1,185 @@
+/*
+ * cachesim - replay a request trace against the proxy's cache
+ *
+ * cachesim [-s sizes] [-p policies] <trace>
+ *     replay trace once for every cache size and eviction policy and
+ *     report hit ratio, byte hit ratio, evictions and lookups per second
+ *
+ *     -s  comma separated cache budgets with k/m/g suffixes,
+ *         default 256k,1m,4m,16m
+ *     -p  comma separated policies out of lru and fifo, default both
+ *
+ * The trace is either a text file with one "uri size" request per line
+ * or a binary access log written by the proxy with -g, whose hits and
+ * misses are replayed under their URI hash with the bytes they sent.
+ *
+ * Every request looks its URI up with cache_match() and a miss is
+ * cache_insert()ed with size bytes, as the proxy does after fetching it;
+ * no sockets are involved, so the lookup rate is that of the cache
+ * alone. Objects over MAX_OBJECT_SIZE are never cached, as in the proxy.
+ */
+
+#include "csapp.h"
+#include "cache.h"
+#include "accesslog.h"
+
+/* one request of the trace */
+typedef struct {
+    char *uri;
+    size_t size;
+} request_t;
+
+static request_t *trace;
+static long ntrace, trace_cap;
+
+/* the object inserted on every miss, only its size matters */
+static char object[MAX_OBJECT_SIZE];
+
+/* wall clock time in ms */
+static double now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void usage(char *prog) {
+    fprintf(stderr, "usage: %s [-s sizes] [-p policies] <trace>\n", prog);
+    fprintf(stderr, "  -s  cache budgets, e.g. 256k,1m,4m,16m\n");
+    fprintf(stderr, "  -p  eviction policies, e.g. lru,fifo\n");
+    exit(1);
+}
+
+/* append a request to the trace */
+static void add_request(char *uri, size_t size) {
+    if (ntrace == trace_cap) {
+        trace_cap = trace_cap ? 2 * trace_cap : 4096;
+        if ((trace = realloc(trace, trace_cap * sizeof(request_t))) == NULL) {
+            unix_error("realloc error");
+        }
+    }
+    if ((trace[ntrace].uri = strdup(uri)) == NULL) {
+        unix_error("strdup error");
+    }
+    trace[ntrace++].size = size;
+}
+
+/* load a text trace or an access log from path */
+static void load_trace(char *path) {
+    char buf[MAXLINE], uri[MAXLINE], magic[8];
+    unsigned long size;
+    log_record rec;
+    rio_t rio;
+    int fd = Open(path, O_RDONLY, 0);
+
+    Rio_readinitb(&rio, fd);
+    if (Rio_readnb(&rio, magic, 8) == 8 && !memcmp(magic, LOG_MAGIC, 8)) {
+        while (Rio_readnb(&rio, &rec, sizeof(rec)) == sizeof(rec)) {
+            if (rec.source == LOG_HIT || rec.source == LOG_MISS) {
+                sprintf(uri, "%016lx", (unsigned long)rec.uri_hash);
+                add_request(uri, rec.bytes);
+            }
+        }
+    }
+    else {
+        rio_freeb(&rio);
+        Close(fd);
+        fd = Open(path, O_RDONLY, 0);
+        Rio_readinitb(&rio, fd);
+        while (Rio_readlineb(&rio, buf, MAXLINE) > 0) {
+            if (sscanf(buf, "%s %lu", uri, &size) == 2) {
+                add_request(uri, size);
+            }
+        }
+    }
+    Close(fd);
+}
+
+/* replay the trace against a cache of budget bytes and print one row */
+static void replay(char *budget_spec, long budget, int policy) {
+    cache *c = cache_init();
+    long i, hits = 0;
+    unsigned long bytes = 0, hit_bytes = 0;
+    double start, secs;
+
+    c->budget = budget;
+    c->policy = policy;
+
+    start = now_ms();
+    for (i = 0; i < ntrace; i++) {
+        cache_block hit, *block = cache_match(c, trace[i].uri, &hit);
+
+        bytes += trace[i].size;
+        if (block != NULL) {
+            hits++;
+            hit_bytes += block->raw_size;
+            cache_release(block);
+        }
+        else if (trace[i].size <= MAX_OBJECT_SIZE) {
+            cache_insert(c, trace[i].uri, object, trace[i].size);
+        }
+    }
+    secs = (now_ms() - start) / 1e3;
+
+    printf("%-6s %8s %10ld %8.2f%% %9.2f%% %10ld %8d %12.0f\n",
+        policy == CACHE_LRU ? "lru" : "fifo", budget_spec, ntrace,
+        ntrace ? 100.0 * hits / ntrace : 0.0,
+        bytes ? 100.0 * hit_bytes / bytes : 0.0,
+        c->evictions, c->entries, secs > 0 ? ntrace / secs : 0.0);
+    cache_deinit(c);
+}
+
+int main(int argc, char **argv) {
+    char *sizes = "256k,1m,4m,16m", *policies = "lru,fifo";
+    char *size_list, *policy_list, *size, *policy, *save1, *save2;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:p:")) != -1) {
+        if (opt == 's') {
+            sizes = optarg;
+        }
+        else if (opt == 'p') {
+            policies = optarg;
+        }
+        else {
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 1) {
+        usage(argv[0]);
+    }
+
+    load_trace(argv[optind]);
+    printf("%-6s %8s %10s %9s %10s %10s %8s %12s\n", "policy", "size",
+        "requests", "hits", "byte hits", "evictions", "entries", "lookups/s");
+
+    policy_list = strdup(policies);
+    for (policy = strtok_r(policy_list, ",", &save1); policy != NULL;
+        policy = strtok_r(NULL, ",", &save1)) {
+        int p;
+
+        if (!strcmp(policy, "lru")) {
+            p = CACHE_LRU;
+        }
+        else if (!strcmp(policy, "fifo")) {
+            p = CACHE_FIFO;
+        }
+        else {
+            usage(argv[0]);
+        }
+
+        size_list = strdup(sizes);
+        for (size = strtok_r(size_list, ",", &save2); size != NULL;
+            size = strtok_r(NULL, ",", &save2)) {
+            long budget = parse_size(size);
+
+            if (budget <= 0) {
+                usage(argv[0]);
+            }
+            replay(size, budget, p);
+        }
+        free(size_list);
+    }
+    free(policy_list);
+    return 0;
+}
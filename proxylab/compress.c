@@ -0,0 +1,165 @@
+/*
+ * compress.c - a small LZ77 codec for cached objects
+ *
+ * Byte format (same layout as LZF):
+ *   000lllll                    literal run of l+1 bytes follows
+ *   LLLooooo oooooooo           back reference of length L+2,
+ *                               distance (o+1) back in the output
+ *   111ooooo LLLLLLLL oooooooo  long back reference of length L+9
+ */
+
+#include <string.h>
+#include "compress.h"
+
+#define LZ_HASH_BITS 12
+#define LZ_HASH_SIZE (1 << LZ_HASH_BITS)
+#define LZ_MAX_LIT (1 << 5)
+#define LZ_MAX_OFF (1 << 13)
+#define LZ_MAX_REF ((1 << 8) + (1 << 3))
+
+/* hash of the three bytes at p */
+static inline unsigned int lz_hash(const unsigned char *p) {
+    unsigned int v = (p[0] << 16) | (p[1] << 8) | p[2];
+    return ((v * 2654435761u) >> (32 - LZ_HASH_BITS)) & (LZ_HASH_SIZE - 1);
+}
+
+/* compress in into out, return 0 if out is too small */
+size_t lz_compress(const char *in, size_t in_len, char *out, size_t out_len) {
+    const unsigned char *base = (const unsigned char *)in;
+    const unsigned char *ip = base;
+    const unsigned char *in_end = base + in_len;
+    unsigned char *op = (unsigned char *)out;
+    unsigned char *out_end = op + out_len;
+    unsigned int htab[LZ_HASH_SIZE];  /* position + 1, 0 means empty */
+    size_t lit = 0;
+
+    if (in_len == 0 || out_len < 2) {
+        return 0;
+    }
+    memset(htab, 0, sizeof(htab));
+
+    /* reserve the control byte of the first literal run */
+    op++;
+
+    while (ip < in_end) {
+        if (ip + 2 < in_end) {
+            unsigned int h = lz_hash(ip);
+            unsigned int prev = htab[h];
+            const unsigned char *ref = base + prev - 1;
+            size_t off = ip - ref - 1;
+            htab[h] = ip - base + 1;
+
+            if (prev && off < LZ_MAX_OFF &&
+                ref[0] == ip[0] && ref[1] == ip[1] && ref[2] == ip[2]) {
+                /* back reference found - extend it as far as possible */
+                size_t len = 3;
+                size_t maxlen = in_end - ip;
+                if (maxlen > LZ_MAX_REF) {
+                    maxlen = LZ_MAX_REF;
+                }
+                while (len < maxlen && ref[len] == ip[len]) {
+                    len++;
+                }
+
+                if (op + 3 > out_end) {
+                    return 0;
+                }
+
+                /* close the current literal run */
+                if (lit) {
+                    op[-lit - 1] = lit - 1;
+                }
+                else {
+                    op--;
+                }
+
+                ip += len;
+                len -= 2;
+                if (len < 7) {
+                    *op++ = (off >> 8) + (len << 5);
+                }
+                else {
+                    *op++ = (off >> 8) + (7 << 5);
+                    *op++ = len - 7;
+                }
+                *op++ = off;
+
+                /* start a new literal run */
+                lit = 0;
+                op++;
+                continue;
+            }
+        }
+
+        /* no match, copy one literal byte */
+        if (op >= out_end) {
+            return 0;
+        }
+        *op++ = *ip++;
+        lit++;
+        if (lit == LZ_MAX_LIT) {
+            op[-lit - 1] = lit - 1;
+            lit = 0;
+            op++;
+        }
+    }
+
+    /* close the last literal run */
+    if (lit) {
+        op[-lit - 1] = lit - 1;
+    }
+    else {
+        op--;
+    }
+
+    return op - (unsigned char *)out;
+}
+
+/* decompress in into out, return 0 on error */
+size_t lz_decompress(const char *in, size_t in_len, char *out, size_t out_len) {
+    const unsigned char *ip = (const unsigned char *)in;
+    const unsigned char *in_end = ip + in_len;
+    unsigned char *op = (unsigned char *)out;
+    unsigned char *out_end = op + out_len;
+
+    while (ip < in_end) {
+        unsigned int ctrl = *ip++;
+
+        if (ctrl < LZ_MAX_LIT) {
+            /* literal run */
+            size_t len = ctrl + 1;
+            if (ip + len > in_end || op + len > out_end) {
+                return 0;
+            }
+            memcpy(op, ip, len);
+            op += len;
+            ip += len;
+        }
+        else {
+            /* back reference, may overlap the bytes it produces */
+            size_t len = ctrl >> 5;
+            const unsigned char *ref;
+
+            if (len == 7) {
+                if (ip >= in_end) {
+                    return 0;
+                }
+                len += *ip++;
+            }
+            len += 2;
+
+            if (ip >= in_end) {
+                return 0;
+            }
+            ref = op - ((ctrl & 0x1f) << 8) - *ip++ - 1;
+            if (ref < (unsigned char *)out || op + len > out_end) {
+                return 0;
+            }
+            while (len--) {
+                *op++ = *ref++;
+            }
+        }
+    }
+
+    return op - (unsigned char *)out;
+}
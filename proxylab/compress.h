@@ -0,0 +1,26 @@
+#ifndef __COMPRESS_H__
+#define __COMPRESS_H__
+
+#include <stddef.h>
+
+/*
+ * A small LZ77 codec (LZF-style byte format) used to keep text-like
+ * objects compressed in the cache. It trades ratio for speed: a single
+ * hash probe per position and no entropy coding.
+ */
+
+/*
+ * compress in_len bytes from in into out (at most out_len bytes)
+ * return the compressed size
+ * return 0 if the data did not fit into out (not worth compressing)
+ */
+size_t lz_compress(const char *in, size_t in_len, char *out, size_t out_len);
+
+/*
+ * decompress in_len bytes from in into out (at most out_len bytes)
+ * return the decompressed size
+ * return 0 on corrupted input or if out is too small
+ */
+size_t lz_decompress(const char *in, size_t in_len, char *out, size_t out_len);
+
+#endif
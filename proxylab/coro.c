@@ -0,0 +1,322 @@
+#include <sys/epoll.h>
+#include <ucontext.h>
+#include "csapp.h"
+#include "proxy.h"
+#include "coro.h"
+
+#define CORO_STACK (1 << 20)    //virtual size of a stack, touched on demand
+#define CORO_GUARD 4096         //inaccessible bottom of a stack
+#define CORO_POOL 64            //stacks a reactor keeps for reuse
+#define CORO_EVENTS 256
+#define CORO_SWEEP 100          //ms between checks for passed deadlines
+
+/* a connection being served */
+typedef struct coro {
+    ucontext_t ctx;
+    char *stack;
+    conn_t *conn;
+    int done;                   //the handler returned
+    int wait_fd;                //descriptor waited for, -1 if runnable
+    int timed_out;              //the wait ended by its deadline
+    long deadline;              //rio_clock() time the wait gives up, 0 never
+    struct coro *prev, *next;   //list of waiting coroutines
+    struct coro *next_run;      //run queue
+} coro;
+
+/* the scheduler of one thread */
+typedef struct {
+    int epfd;
+    int listenfd;               //-1 once the proxy drains
+    int idle_ms;
+    void (*handler)(conn_t *conn);
+    ucontext_t sched;           //context of the reactor loop
+    coro *current;              //running coroutine, NULL in the loop
+    coro waiting;               //dummy head of the waiting coroutines
+    coro *run_head, *run_tail;
+    coro **by_fd;               //coroutine waiting for each descriptor
+    int nfds;
+    char *stacks[CORO_POOL];
+    int nstacks;
+} reactor;
+
+static __thread reactor *self;
+
+/* get a stack with a guard page below it */
+static char *coro_stack(reactor *r) {
+    char *stack;
+
+    if (r->nstacks > 0) {
+        return r->stacks[--r->nstacks];
+    }
+    stack = mmap(NULL, CORO_STACK, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (stack == MAP_FAILED) {
+        return NULL;
+    }
+    mprotect(stack, CORO_GUARD, PROT_NONE);
+    return stack;
+}
+
+/* keep a stack for the next coroutine or give it back */
+static void coro_unstack(reactor *r, char *stack) {
+    if (r->nstacks < CORO_POOL) {
+        r->stacks[r->nstacks++] = stack;
+    }
+    else {
+        munmap(stack, CORO_STACK);
+    }
+}
+
+/* queue c to run */
+static void coro_ready(reactor *r, coro *c) {
+    c->next_run = NULL;
+    if (r->run_tail == NULL) {
+        r->run_head = c;
+    }
+    else {
+        r->run_tail->next_run = c;
+    }
+    r->run_tail = c;
+}
+
+/* end the wait of c and queue it to run */
+static void coro_wake(reactor *r, coro *c, int timed_out) {
+    c->prev->next = c->next;
+    c->next->prev = c->prev;
+    r->by_fd[c->wait_fd] = NULL;
+    c->wait_fd = -1;
+    c->timed_out = timed_out;
+    coro_ready(r, c);
+}
+
+/* make room in by_fd for descriptor fd, return -1 if out of memory */
+static int coro_grow(reactor *r, int fd) {
+    int n = r->nfds ? r->nfds : 1024;
+    coro **by_fd;
+
+    while (n <= fd) {
+        n *= 2;
+    }
+    if ((by_fd = realloc(r->by_fd, n * sizeof(coro *))) == NULL) {
+        return -1;
+    }
+    memset(by_fd + r->nfds, 0, (n - r->nfds) * sizeof(coro *));
+    r->by_fd = by_fd;
+    r->nfds = n;
+    return 0;
+}
+
+/*
+ * the rio waiter of a reactor thread: park the running coroutine until
+ * fd is ready or the deadline passes
+ */
+static int coro_wait(int fd, int events, long deadline) {
+    reactor *r = self;
+    coro *c = r->current;
+    struct epoll_event ev;
+    int rc;
+
+    /* the loop itself, e.g. refusing a client, waits the usual way */
+    if (c == NULL) {
+        rio_setwaiter(NULL);
+        rc = rio_poll(fd, events, deadline);
+        rio_setwaiter(coro_wait);
+        return rc;
+    }
+
+    if (r->idle_ms) {
+        long idle = rio_clock() + r->idle_ms;
+        if (!deadline || idle < deadline) {
+            deadline = idle;
+        }
+    }
+    if (fd >= r->nfds && coro_grow(r, fd) < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    /* one shot: the descriptor is quiet again once it woke us */
+    ev.events = EPOLLONESHOT;
+    if (events & POLLIN) {
+        ev.events |= EPOLLIN;
+    }
+    if (events & POLLOUT) {
+        ev.events |= EPOLLOUT;
+    }
+    ev.data.fd = fd;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_MOD, fd, &ev) < 0 &&
+        (errno != ENOENT || epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)) {
+        return -1;
+    }
+
+    c->wait_fd = fd;
+    c->deadline = deadline;
+    r->by_fd[fd] = c;
+    c->next = r->waiting.next;
+    c->prev = &r->waiting;
+    r->waiting.next->prev = c;
+    r->waiting.next = c;
+
+    swapcontext(&c->ctx, &r->sched);
+
+    if (c->timed_out) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return 0;
+}
+
+/* body of every coroutine, returns into the reactor loop */
+static void coro_main(void) {
+    reactor *r = self;
+    coro *c = r->current;
+
+    r->handler(c->conn);
+    c->done = 1;
+}
+
+/* start a coroutine serving conn */
+static void coro_spawn(reactor *r, conn_t *conn) {
+    coro *c = calloc(1, sizeof(coro));
+
+    if (c == NULL || (c->stack = coro_stack(r)) == NULL) {
+        free(c);
+        limiter_release(client_limit, conn->client);
+        Close(conn->fd);
+        conn_free(conn);
+        return;
+    }
+    getcontext(&c->ctx);
+    c->ctx.uc_stack.ss_sp = c->stack;
+    c->ctx.uc_stack.ss_size = CORO_STACK;
+    c->ctx.uc_link = &r->sched;
+    makecontext(&c->ctx, coro_main, 0);
+    c->conn = conn;
+    c->wait_fd = -1;
+    coro_ready(r, c);
+}
+
+/* accept every pending connection */
+static void coro_accept(reactor *r) {
+    struct sockaddr_in addr;
+    socklen_t addrlen;
+    conn_t *conn;
+    int fd;
+
+    while (1) {
+        addrlen = sizeof(addr);
+        fd = accept4(r->listenfd, (SA *)&addr, &addrlen,
+            SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            /* EAGAIN, or e.g. out of descriptors: serve the others */
+            return;
+        }
+        if ((conn = conn_alloc(fd)) == NULL) {
+            close(fd);
+            continue;
+        }
+        inet_ntop(AF_INET, &addr.sin_addr, conn->client, INET_ADDRSTRLEN);
+        if (admit(fd, conn->client) < 0) {
+            conn_free(conn);
+            continue;
+        }
+        coro_spawn(r, conn);
+    }
+}
+
+/* run every runnable coroutine until it waits or finishes */
+static void coro_run(reactor *r) {
+    coro *c;
+
+    while ((c = r->run_head) != NULL) {
+        r->run_head = c->next_run;
+        if (r->run_head == NULL) {
+            r->run_tail = NULL;
+        }
+        r->current = c;
+        swapcontext(&r->sched, &c->ctx);
+        r->current = NULL;
+
+        if (c->done) {
+            coro_unstack(r, c->stack);
+            free(c);
+        }
+    }
+}
+
+/* run a reactor on listenfd */
+int coro_serve(int listenfd, int idle_ms, void (*handler)(conn_t *conn)) {
+    struct epoll_event ev, events[CORO_EVENTS];
+    long last_sweep = rio_clock();
+    reactor *r;
+    int i, n;
+
+    if ((r = calloc(1, sizeof(reactor))) == NULL) {
+        return -1;
+    }
+    if ((r->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        free(r);
+        return -1;
+    }
+    r->listenfd = listenfd;
+    r->idle_ms = idle_ms;
+    r->handler = handler;
+    r->waiting.prev = r->waiting.next = &r->waiting;
+
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+    ev.events = EPOLLIN;
+    ev.data.fd = listenfd;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0) {
+        close(r->epfd);
+        free(r);
+        return -1;
+    }
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = drain_fd;
+    epoll_ctl(r->epfd, EPOLL_CTL_ADD, drain_fd, &ev);
+
+    self = r;
+    rio_setwaiter(coro_wait);
+
+    while (1) {
+        coro_run(r);
+
+        n = epoll_wait(r->epfd, events, CORO_EVENTS,
+            (r->waiting.next != &r->waiting) ? CORO_SWEEP : -1);
+        if (n < 0 && errno != EINTR) {
+            unix_error("coro epoll_wait error");
+        }
+
+        for (i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+
+            if (fd == r->listenfd) {
+                coro_accept(r);
+            }
+            else if (fd == drain_fd && r->listenfd >= 0) {
+                /* the coroutines running go on to the end */
+                epoll_ctl(r->epfd, EPOLL_CTL_DEL, r->listenfd, NULL);
+                unlisten(r->listenfd);
+                r->listenfd = -1;
+            }
+            else if (fd < r->nfds && r->by_fd[fd] != NULL) {
+                coro_wake(r, r->by_fd[fd], 0);
+            }
+        }
+
+        /* end the waits whose deadline passed */
+        if (rio_clock() - last_sweep >= CORO_SWEEP) {
+            long now = rio_clock();
+            coro *c, *next;
+
+            for (c = r->waiting.next; c != &r->waiting; c = next) {
+                next = c->next;
+                if (c->deadline && now >= c->deadline) {
+                    coro_wake(r, c, 1);
+                }
+            }
+            last_sweep = now;
+        }
+    }
+    return 0;
+}
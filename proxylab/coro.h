@@ -0,0 +1,33 @@
+#ifndef __CORO_H__
+#define __CORO_H__
+
+#include "proxy.h"
+
+/*
+ * coroutine front end for client connections
+ *
+ * Each connection is served by a coroutine with its own stack running
+ * the same straight-line handler as a thread would, on a reactor
+ * thread that owns the listening socket and an epoll instance. All
+ * descriptors are non-blocking; when rio or a connect would block, the
+ * reactor installed as the thread's rio waiter (see rio_setwaiter)
+ * parks the coroutine until epoll reports its descriptor ready or its
+ * deadline passes, and runs the next one. A few reactor threads can so
+ * hold tens of thousands of requests in flight, limited by memory for
+ * their stacks rather than by threads.
+ *
+ * Host name lookups and cache locks still block the reactor thread
+ * for their (short) duration.
+ */
+
+/*
+ * accept connections on listenfd and run handler for each on a new
+ * coroutine; handler owns the conn_t and must free it
+ * every wait for a descriptor is bounded by idle_ms (0 for none)
+ * when the proxy drains, the reactor stops accepting and unlisten()s,
+ * and serves the coroutines it has until the process exits
+ * never returns, unless the reactor cannot be set up: return -1
+ */
+int coro_serve(int listenfd, int idle_ms, void (*handler)(conn_t *conn));
+
+#endif
@@ -1,5 +1,6 @@
 /* $begin csapp.c */
 #include "csapp.h"
+#include "bufpool.h"
 
 /* Updated with a reentrant open_clientfd_r function */
 
@@ -521,9 +522,116 @@ void V(sem_t *sem)
 	unix_error("V error");
 }
 
+/****************************************************************
+ * Lock-free bounded MPMC queue (D. Vyukov's sequence numbered ring)
+ ****************************************************************/
+
+/*
+ * Every cell carries a sequence number telling whose turn it is. Cell
+ * i of lap k holds seq == pos when free for the producer at position
+ * pos = k * n + i, and seq == pos + 1 once that producer has stored its
+ * item, for the consumer at the same pos. Producers and consumers only
+ * race for their own counter with a compare and swap, never for a lock.
+ */
+struct mpmc_cell {
+    size_t seq;
+    void *item;
+};
+
+/*
+ * mpmc_init - make q an empty queue of n slots, n a power of 2.
+ *    Returns -1 and sets errno if n is not or out of memory.
+ */
+int mpmc_init(mpmc_t *q, size_t n)
+{
+    size_t i;
+
+    if (n < 2 || (n & (n - 1))) {
+	errno = EINVAL;
+	return -1;
+    }
+    if ((q->cells = malloc(n * sizeof(struct mpmc_cell))) == NULL)
+	return -1;
+    for (i = 0; i < n; i++)
+	q->cells[i].seq = i;
+    q->mask = n - 1;
+    q->tail = q->head = 0;
+    return 0;
+}
+
+void mpmc_deinit(mpmc_t *q)
+{
+    free(q->cells);
+}
+
+/*
+ * mpmc_push - append item to q. Returns -1 if q is full, which it may
+ *    also be for a moment while a consumer is still taking the item of
+ *    the slot to be filled.
+ */
+int mpmc_push(mpmc_t *q, void *item)
+{
+    struct mpmc_cell *cell;
+    size_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    long dif;
+
+    while (1) {
+	cell = &q->cells[pos & q->mask];
+	dif = (long)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+	if (dif == 0) {
+	    /* the slot is free, claim position pos */
+	    if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		break;
+	}
+	else if (dif < 0)
+	    return -1;          /* the slot still holds an item of lap - 1 */
+	else
+	    pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    }
+    cell->item = item;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * mpmc_pop - take the first item of q into *item. Returns -1 if q is
+ *    empty, which it may also be for a moment while a producer is still
+ *    storing the first item.
+ */
+int mpmc_pop(mpmc_t *q, void **item)
+{
+    struct mpmc_cell *cell;
+    size_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    long dif;
+
+    while (1) {
+	cell = &q->cells[pos & q->mask];
+	dif = (long)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+	if (dif == 0) {
+	    /* the slot is filled, claim position pos */
+	    if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		break;
+	}
+	else if (dif < 0)
+	    return -1;          /* the slot waits for its producer */
+	else
+	    pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    }
+    *item = cell->item;
+    /* free the slot for the producer of the next lap */
+    __atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
 /*********************************************************************
  * The Rio package - robust I/O functions
  **********************************************************************/
+
+/* waits for the descriptors of this thread, see rio_setwaiter() */
+static __thread rio_waiter_t rio_waiter;
+
 /*
  * rio_readn - robustly read n bytes (unbuffered)
  */
@@ -538,8 +646,12 @@ ssize_t rio_readn(int fd, void *usrbuf, size_t n)
 	if ((nread = read(fd, bufp, nleft)) < 0) {
 	    if (errno == EINTR) /* interrupted by sig handler return */
 		nread = 0;      /* and call read() again */
+	    else if (errno == EAGAIN && rio_waiter)
+		nread = (rio_poll(fd, POLLIN, 0) < 0) ? -1 : 0;
 	    else
 		return -1;      /* errno set by read() */ 
+	    if (nread < 0)
+		return -1;
 	} 
 	else if (nread == 0)
 	    break;              /* EOF */
@@ -564,6 +676,9 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 	if ((nwritten = write(fd, bufp, nleft)) <= 0) {
 	    if (errno == EINTR)  /* interrupted by sig handler return */
 		nwritten = 0;    /* and call write() again */
+	    else if (errno == EAGAIN && rio_waiter &&
+		     rio_poll(fd, POLLOUT, 0) == 0)
+		nwritten = 0;    /* writable again */
 	    else
 		return -1;       /* errorno set by write() */
 	}
@@ -574,6 +689,93 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 }
 /* $end rio_writen */
 
+/*
+ * rio_writevn - robustly write the iovcnt (at most IOV_MAX) buffers of
+ *    iov with as few writev calls as the socket takes (unbuffered); iov
+ *    is advanced past the bytes written
+ */
+ssize_t rio_writevn(int fd, struct iovec *iov, int iovcnt)
+{
+    size_t n = 0;
+    ssize_t nwritten;
+    int i;
+
+    for (i = 0; i < iovcnt; i++)
+	n += iov[i].iov_len;
+
+    while (iovcnt > 0) {
+	if ((nwritten = writev(fd, iov, iovcnt)) <= 0) {
+	    if (errno == EINTR)  /* interrupted by sig handler return */
+		nwritten = 0;    /* and call writev() again */
+	    else if (errno == EAGAIN && rio_waiter &&
+		     rio_poll(fd, POLLOUT, 0) == 0)
+		nwritten = 0;    /* writable again */
+	    else
+		return -1;       /* errorno set by writev() */
+	}
+	/* skip the buffers written, and the part written of the next */
+	while (iovcnt > 0 && (size_t)nwritten >= iov->iov_len) {
+	    nwritten -= iov->iov_len;
+	    iov++;
+	    iovcnt--;
+	}
+	if (iovcnt > 0) {
+	    iov->iov_base = (char *)iov->iov_base + nwritten;
+	    iov->iov_len -= nwritten;
+	}
+    }
+    return n;
+}
+
+
+/*
+ * rio_poll - wait until fd has one of events (POLLIN, POLLOUT) or the
+ *    rio_clock() time deadline (0 for none) passes, through the calling
+ *    thread's waiter if it has one. Returns 0 if ready, -1 with errno
+ *    ETIMEDOUT otherwise.
+ */
+int rio_poll(int fd, int events, long deadline)
+{
+    struct pollfd pfd;
+    long left;
+    int rc;
+
+    if (rio_waiter)
+	return rio_waiter(fd, events, deadline);
+
+    pfd.fd = fd;
+    pfd.events = events;
+    while (!deadline || (left = deadline - rio_clock()) > 0) {
+	if ((rc = poll(&pfd, 1, deadline ? left : -1)) > 0)
+	    return 0;
+	if (rc < 0 && errno != EINTR)
+	    return -1;
+    }
+    errno = ETIMEDOUT;
+    return -1;
+}
+
+/*
+ * rio_setwaiter - make rio and open_clientfd_timeout wait for
+ *    descriptors of the calling thread with waiter instead of blocking
+ *    in the kernel; NULL restores the default
+ */
+void rio_setwaiter(rio_waiter_t waiter)
+{
+    rio_waiter = waiter;
+}
+
+/*
+ * rio_late - return 1 and set errno to ETIMEDOUT if rp's deadline has
+ *    passed, 0 otherwise
+ */
+static int rio_late(rio_t *rp)
+{
+    if (!rp->rio_deadline || rio_clock() < rp->rio_deadline)
+	return 0;
+    errno = ETIMEDOUT;
+    return 1;
+}
 
 /* 
  * rio_read - This is a wrapper for the Unix read() function that
@@ -581,7 +783,14 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
  *    buffer, where n is the number of bytes requested by the user and
  *    rio_cnt is the number of unread bytes in the internal buffer. On
  *    entry, rio_read() refills the internal buffer via a call to
- *    read() if the internal buffer is empty.
+ *    read() if the internal buffer is empty. The internal buffer is
+ *    taken from the buf_get() pool on refill and handed back once it
+ *    is drained, so an idle rio_t holds no buffer. A refill reads
+ *    straight away: a blocking descriptor is bounded by its own receive
+ *    timeout, and rio_deadline is checked once read() returns. Only a
+ *    read() that finds nothing on a descriptor of a thread with a
+ *    waiter waits, through rio_poll(). Fails with ETIMEDOUT once the
+ *    deadline has passed.
  */
 /* $begin rio_read */
 static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
@@ -589,14 +798,33 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
     int cnt;
 
     while (rp->rio_cnt <= 0) {  /* refill if buf is empty */
-	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
-			   sizeof(rp->rio_buf));
+	if (rp->rio_buf == NULL &&
+	    (rp->rio_buf = buf_get(RIO_BUFSIZE)) == NULL)
+	    return -1;          /* out of memory */
+	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, RIO_BUFSIZE);
+	if (rp->rio_cnt > 0 && rio_late(rp)) {
+	    rio_freeb(rp);
+	    return -1;          /* deadline passed, errno is ETIMEDOUT */
+	}
 	if (rp->rio_cnt < 0) {
-	    if (errno != EINTR) /* interrupted by sig handler return */
+	    if (errno == EAGAIN && rio_waiter) {
+		/* non-blocking descriptor, wait for it and read again */
+		if (rio_poll(rp->rio_fd, POLLIN, rp->rio_deadline) < 0) {
+		    rio_freeb(rp);
+		    return -1;
+		}
+	    }
+	    else if (errno != EINTR) { /* interrupted by sig handler return */
+		if (errno == EAGAIN)
+		    rio_late(rp); /* receive timeout, ETIMEDOUT if past deadline */
+		rio_freeb(rp);
 		return -1;
+	    }
 	}
-	else if (rp->rio_cnt == 0)  /* EOF */
+	else if (rp->rio_cnt == 0) { /* EOF */
+	    rio_freeb(rp);
 	    return 0;
+	}
 	else 
 	    rp->rio_bufptr = rp->rio_buf; /* reset buffer ptr */
     }
@@ -608,10 +836,44 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
     memcpy(usrbuf, rp->rio_bufptr, cnt);
     rp->rio_bufptr += cnt;
     rp->rio_cnt -= cnt;
+
+    /* a drained buffer goes back to the pool until the next refill */
+    if (rp->rio_cnt == 0)
+	rio_freeb(rp);
     return cnt;
 }
 /* $end rio_read */
 
+/*
+ * rio_readsomeb - read up to n bytes through rp with a single read(),
+ *    as many as have arrived; bytes buffered in rp come first. With
+ *    nothing buffered and n of at least RIO_BUFSIZE the read goes
+ *    straight into usrbuf, without the copy through rp's buffer.
+ *    Returns the bytes read, 0 on EOF, -1 on error.
+ */
+ssize_t rio_readsomeb(rio_t *rp, void *usrbuf, size_t n)
+{
+    ssize_t nread;
+
+    if (rp->rio_cnt > 0 || n < RIO_BUFSIZE)
+	return rio_read(rp, usrbuf, n);
+
+    while (1) {
+	if ((nread = read(rp->rio_fd, usrbuf, n)) >= 0)
+	    return (nread > 0 && rio_late(rp)) ? -1 : nread;
+	if (errno == EAGAIN && rio_waiter) {
+	    /* non-blocking descriptor, wait for it and read again */
+	    if (rio_poll(rp->rio_fd, POLLIN, rp->rio_deadline) < 0)
+		return -1;
+	}
+	else if (errno != EINTR) { /* interrupted by sig handler return */
+	    if (errno == EAGAIN)
+		rio_late(rp);   /* receive timeout, ETIMEDOUT if past deadline */
+	    return -1;
+	}
+    }
+}
+
 /*
  * rio_readinitb - Associate a descriptor with a read buffer and reset buffer
  */
@@ -620,10 +882,161 @@ void rio_readinitb(rio_t *rp, int fd)
 {
     rp->rio_fd = fd;  
     rp->rio_cnt = 0;  
-    rp->rio_bufptr = rp->rio_buf;
+    rp->rio_buf = NULL;
+    rp->rio_bufptr = NULL;
+    rp->rio_deadline = 0;
 }
 /* $end rio_readinitb */
 
+/*
+ * rio_unread - make n bytes read from rp's descriptor elsewhere the next
+ *    bytes read through rp; rp must have no unread bytes and n be at
+ *    most RIO_BUFSIZE; return -1 if out of memory
+ */
+int rio_unread(rio_t *rp, void *usrbuf, size_t n)
+{
+    if (n == 0)
+	return 0;
+    if (rp->rio_buf == NULL && (rp->rio_buf = buf_get(RIO_BUFSIZE)) == NULL)
+	return -1;
+    memcpy(rp->rio_buf, usrbuf, n);
+    rp->rio_bufptr = rp->rio_buf;
+    rp->rio_cnt = n;
+    return 0;
+}
+
+/*
+ * rio_freeb - give rp's buffer back to the buffer pool, dropping any
+ *    unread bytes; rp reads on with a new buffer
+ */
+void rio_freeb(rio_t *rp)
+{
+    buf_put(rp->rio_buf);
+    rp->rio_buf = NULL;
+    rp->rio_bufptr = NULL;
+    rp->rio_cnt = 0;
+}
+
+/*
+ * rio_pending - return the bytes buffered in rp but not read yet and
+ *    their count in *n; NULL if there are none
+ */
+char *rio_pending(rio_t *rp, size_t *n)
+{
+    *n = rp->rio_cnt > 0 ? rp->rio_cnt : 0;
+    return *n ? rp->rio_bufptr : NULL;
+}
+
+/*
+ * rio_consume - drop the first n of the bytes rio_pending() returned
+ */
+void rio_consume(rio_t *rp, size_t n)
+{
+    rp->rio_bufptr += n;
+    rp->rio_cnt -= n;
+    if (rp->rio_cnt == 0)
+	rio_freeb(rp);
+}
+
+/*
+ * Non-blocking reads for event loops. rp's descriptor must be in
+ * O_NONBLOCK mode. Where a blocking read would wait, these return
+ * RIO_AGAIN instead and keep whatever arrived in rp's buffer, so
+ * calling again once the descriptor is readable picks up where the
+ * last call left off, in the middle of a line if need be.
+ */
+
+/*
+ * rio_tryfill - move rp's unread bytes to the front of its buffer and
+ *    read what the descriptor has into the rest. Returns the bytes
+ *    added, 0 on EOF or if the buffer is full, RIO_AGAIN if there is
+ *    nothing to read yet, -1 on error.
+ */
+static ssize_t rio_tryfill(rio_t *rp)
+{
+    ssize_t n;
+
+    if (rp->rio_buf == NULL && (rp->rio_buf = buf_get(RIO_BUFSIZE)) == NULL)
+	return -1;              /* out of memory */
+    if (rp->rio_cnt <= 0) {
+	rp->rio_cnt = 0;
+	rp->rio_bufptr = rp->rio_buf;
+    }
+    else if (rp->rio_bufptr != rp->rio_buf) {
+	memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+	rp->rio_bufptr = rp->rio_buf;
+    }
+    if (rp->rio_cnt == RIO_BUFSIZE)
+	return 0;
+
+    while ((n = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt,
+		     RIO_BUFSIZE - rp->rio_cnt)) < 0 && errno == EINTR)
+	;
+    if (n > 0)
+	rp->rio_cnt += n;
+    else if (rp->rio_cnt == 0)
+	rio_freeb(rp);          /* nothing held, keep no buffer */
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	return RIO_AGAIN;
+    return n;
+}
+
+/*
+ * rio_tryreadlineb - rio_readlineb() without blocking. Returns the
+ *    length of the line copied to usrbuf, 0 on EOF, RIO_AGAIN if the
+ *    line is not complete yet, -1 on error. A longer line than fits
+ *    comes in pieces of maxlen - 1, or at most RIO_BUFSIZE, bytes.
+ */
+ssize_t rio_tryreadlineb(rio_t *rp, void *usrbuf, size_t maxlen)
+{
+    char *eol;
+    size_t n;
+    ssize_t rc;
+
+    while (1) {
+	n = (rp->rio_cnt > 0) ? rp->rio_cnt : 0;
+	if (n > maxlen - 1)
+	    n = maxlen - 1;
+	if (n > 0 && (eol = memchr(rp->rio_bufptr, '\n', n)) != NULL)
+	    n = eol - rp->rio_bufptr + 1;
+	else if (n < maxlen - 1 && n < RIO_BUFSIZE) {
+	    /* no whole line yet, read on */
+	    if ((rc = rio_tryfill(rp)) > 0)
+		continue;
+	    if (rc < 0)
+		return rc;
+	    /* EOF, the rest is the last line */
+	    if (rp->rio_cnt == 0)
+		return 0;
+	    n = rp->rio_cnt;
+	}
+	memcpy(usrbuf, rp->rio_bufptr, n);
+	((char *)usrbuf)[n] = 0;
+	rio_consume(rp, n);
+	return n;
+    }
+}
+
+/*
+ * rio_clock - monotonic time in milliseconds, the clock of rio deadlines
+ */
+long rio_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/*
+ * rio_setdeadline - make buffered reads on rp fail with ETIMEDOUT once
+ *    rio_clock() reaches deadline; 0 removes the deadline
+ */
+void rio_setdeadline(rio_t *rp, long deadline)
+{
+    rp->rio_deadline = deadline;
+}
+
 /*
  * rio_readnb - Robustly read n bytes (buffered)
  */
@@ -760,16 +1173,64 @@ int open_clientfd(char *hostname, int port)
  * open_clientfd_r - thread-safe version of open_clientfd
  */
 int open_clientfd_r(char *hostname, int port) {
-    int clientfd;
+    return open_clientfd_timeout(hostname, port, 0);
+}
+
+static int open_listenfd_opt(int port, int reuseport);
+
+/*
+ * connect_timeout - connect with a timeout in milliseconds (0 for none)
+ *    Returns 0 on success, -1 and sets errno otherwise. Under a waiter
+ *    the descriptor is left non-blocking.
+ */
+static int connect_timeout(int fd, struct sockaddr *addr, socklen_t len,
+    int timeout) {
+    int flags, err, rc;
+    socklen_t errlen = sizeof(err);
+
+    if (timeout <= 0 && !rio_waiter) {
+        return connect(fd, addr, len);
+    }
+
+    flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    if ((rc = connect(fd, addr, len)) < 0 && errno == EINPROGRESS) {
+        rc = rio_poll(fd, POLLOUT, timeout > 0 ? rio_clock() + timeout : 0);
+        if (rc == 0) {
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+            if (err) {
+                errno = err;
+                rc = -1;
+            }
+        }
+    }
+    if (!rio_waiter) {
+        fcntl(fd, F_SETFL, flags);
+    }
+    return rc;
+}
+
+/*
+ * open_clientfd_timeout - open_clientfd_r giving up on each address
+ *    after timeout milliseconds (0 for the system default)
+ */
+int open_clientfd_timeout(char *hostname, int port, int timeout) {
+    return open_clientfd_buf(hostname, port, timeout, 0, 0);
+}
+
+/*
+ * open_clientfd_buf - open_clientfd_timeout with SO_RCVBUF and SO_SNDBUF
+ *    of rcvbuf and sndbuf bytes, set before connecting so the window
+ *    scale is negotiated for them; 0 leaves a buffer to the kernel's
+ *    autotuning
+ */
+int open_clientfd_buf(char *hostname, int port, int timeout,
+    int rcvbuf, int sndbuf) {
+    int clientfd = -1;
     struct addrinfo *addlist, *p;
     char port_str[MAXLINE];
     int rv;
 
-    /* Create the socket descriptor */
-    if ((clientfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        return -1;
-    }
-
     /* Get a list of addrinfo structs */
     sprintf(port_str, "%d", port);
     if ((rv = getaddrinfo(hostname, port_str, NULL, &addlist)) != 0) {
@@ -779,16 +1240,28 @@ int open_clientfd_r(char *hostname, int port) {
     /* Walk the list, using each addrinfo to try to connect */
     for (p = addlist; p; p = p->ai_next) {
         if ((p->ai_family == AF_INET)) {
-            if (connect(clientfd, p->ai_addr, p->ai_addrlen) == 0) {
+            /* Create the socket descriptor */
+            if ((clientfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+                break;
+            }
+            if (rcvbuf > 0) {
+                setsockopt(clientfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(int));
+            }
+            if (sndbuf > 0) {
+                setsockopt(clientfd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(int));
+            }
+            if (connect_timeout(clientfd, p->ai_addr, p->ai_addrlen,
+                    timeout) == 0) {
                 break; /* success */
             }
+            close(clientfd);
+            clientfd = -1;
         }
     } 
 
     /* Clean up */
     freeaddrinfo(addlist);
-    if (!p) { /* all connects failed */
-        close(clientfd);
+    if (!p || clientfd < 0) { /* all connects failed */
         return -1;
     }
     else { /* one of the connects succeeded */
@@ -802,6 +1275,26 @@ int open_clientfd_r(char *hostname, int port) {
  */
 /* $begin open_listenfd */
 int open_listenfd(int port) 
+{
+    return open_listenfd_opt(port, 0);
+}
+/* $end open_listenfd */
+
+/*
+ * open_listenfd_reuseport - open a listening socket on port that shares
+ *     the port with other SO_REUSEPORT sockets; the kernel spreads
+ *     incoming connections across them.
+ *     Returns -1 and sets errno on Unix error.
+ */
+int open_listenfd_reuseport(int port)
+{
+    return open_listenfd_opt(port, 1);
+}
+
+/*
+ * open_listenfd_opt - open_listenfd with SO_REUSEPORT set if reuseport
+ */
+static int open_listenfd_opt(int port, int reuseport)
 {
     int listenfd, optval=1;
     struct sockaddr_in serveraddr;
@@ -813,7 +1306,13 @@ int open_listenfd(int port)
     /* Eliminates "Address already in use" error from bind. */
     if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, 
 		   (const void *)&optval , sizeof(int)) < 0)
-	return -1;
+	goto error;
+
+    /* Lets other reuseport sockets bind the same port */
+    if (reuseport &&
+	setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+		   (const void *)&optval , sizeof(int)) < 0)
+	goto error;
 
     /* Listenfd will be an endpoint for all requests to port
        on any IP address for this host */
@@ -822,14 +1321,17 @@ int open_listenfd(int port)
     serveraddr.sin_addr.s_addr = htonl(INADDR_ANY); 
     serveraddr.sin_port = htons((unsigned short)port); 
     if (bind(listenfd, (SA *)&serveraddr, sizeof(serveraddr)) < 0)
-	return -1;
+	goto error;
 
     /* Make it a listening socket ready to accept connection requests */
     if (listen(listenfd, LISTENQ) < 0)
-	return -1;
+	goto error;
     return listenfd;
+
+ error:
+    close(listenfd);
+    return -1;
 }
-/* $end open_listenfd */
 
 /******************************************
  * Wrappers for the client/server helper routines 
@@ -865,6 +1367,64 @@ int Open_listenfd(int port)
 	unix_error("Open_listenfd error");
     return rc;
 }
+
+int Open_listenfd_reuseport(int port)
+{
+    int rc;
+
+    if ((rc = open_listenfd_reuseport(port)) < 0)
+	unix_error("Open_listenfd_reuseport error");
+    return rc;
+}
+
+/**********
+ * Hashing
+ **********/
+
+/*
+ * fnv1a_hash - 64-bit FNV-1a hash of the string s, the hash behind the
+ *    limiter, prefetch, cache and peer tables and the access log
+ */
+uint64_t fnv1a_hash(const char *s)
+{
+    uint64_t h = 14695981039346656037UL;
+
+    while (*s) {
+	h ^= (unsigned char)*s++;
+	h *= 1099511628211UL;
+    }
+    return h;
+}
+
+/**********
+ * Parsing
+ **********/
+
+/*
+ * parse_size - parse a byte count with an optional k, m or g suffix
+ *    for KiB, MiB or GiB. Returns the count, -1 if spec is malformed.
+ */
+long parse_size(char *spec)
+{
+    char *end;
+    long n = strtol(spec, &end, 10);
+
+    switch (*end) {
+    case 'k': case 'K':
+	n <<= 10;
+	end++;
+	break;
+    case 'm': case 'M':
+	n <<= 20;
+	end++;
+	break;
+    case 'g': case 'G':
+	n <<= 30;
+	end++;
+	break;
+    }
+    return (end == spec || *end != '\0') ? -1 : n;
+}
 /* $end csapp.c */
 
 
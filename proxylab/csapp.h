@@ -10,6 +10,7 @@
 #include <setjmp.h>
 #include <signal.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
@@ -23,6 +24,9 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <stdint.h>
 
 
 /* Default file permissions are DEF_MODE & ~DEF_UMASK */
@@ -43,10 +47,24 @@ typedef struct {
     int rio_fd;                /* descriptor for this internal buf */
     int rio_cnt;               /* unread bytes in internal buf */
     char *rio_bufptr;          /* next unread byte in internal buf */
-    char rio_buf[RIO_BUFSIZE]; /* internal buffer */
+    long rio_deadline;         /* rio_clock() time reads give up, 0 if none */
+    char *rio_buf;             /* internal buffer of RIO_BUFSIZE bytes from
+                                  the buffer pool, held only while it has
+                                  unread bytes, else NULL */
 } rio_t;
 /* $end rio_t */
 
+/* returned by the non-blocking rio_tryreadlineb() when the descriptor has
+ * no more bytes yet, errno is EAGAIN then */
+#define RIO_AGAIN (-2)
+
+/*
+ * waits until fd has one of events or the rio_clock() time deadline
+ * (0 for none) passes; returns 0 if ready, -1 with errno set otherwise
+ * (see rio_setwaiter)
+ */
+typedef int (*rio_waiter_t)(int fd, int events, long deadline);
+
 /* External variables */
 extern int h_errno;    /* defined by BIND for DNS errors */ 
 extern char **environ; /* defined by libc */
@@ -142,12 +160,37 @@ void Sem_init(sem_t *sem, int pshared, unsigned int value);
 void P(sem_t *sem);
 void V(sem_t *sem);
 
+/* Lock-free bounded multi-producer multi-consumer queue of pointers */
+struct mpmc_cell;
+typedef struct {
+    struct mpmc_cell *cells;   /* mask + 1 slots */
+    size_t mask;
+    size_t tail __attribute__((aligned(64))); /* next position to fill */
+    size_t head __attribute__((aligned(64))); /* next position to take */
+} mpmc_t;
+
+int mpmc_init(mpmc_t *q, size_t n);
+void mpmc_deinit(mpmc_t *q);
+int mpmc_push(mpmc_t *q, void *item);
+int mpmc_pop(mpmc_t *q, void **item);
+
 /* Rio (Robust I/O) package */
 ssize_t rio_readn(int fd, void *usrbuf, size_t n);
 ssize_t rio_writen(int fd, void *usrbuf, size_t n);
+ssize_t rio_writevn(int fd, struct iovec *iov, int iovcnt);
 void rio_readinitb(rio_t *rp, int fd); 
+int rio_unread(rio_t *rp, void *usrbuf, size_t n);
+void rio_freeb(rio_t *rp);
 ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t	rio_readsomeb(rio_t *rp, void *usrbuf, size_t n);
+char *rio_pending(rio_t *rp, size_t *n);
+void rio_consume(rio_t *rp, size_t n);
+ssize_t	rio_tryreadlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+long rio_clock(void);
+void rio_setdeadline(rio_t *rp, long deadline);
+int rio_poll(int fd, int events, long deadline);
+void rio_setwaiter(rio_waiter_t waiter);
 
 /* Wrappers for Rio package */
 ssize_t Rio_readn(int fd, void *usrbuf, size_t n);
@@ -159,12 +202,23 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 /* Client/server helper functions */
 int open_clientfd(char *hostname, int portno);
 int open_clientfd_r(char *hostname, int portno);
+int open_clientfd_timeout(char *hostname, int portno, int timeout);
+int open_clientfd_buf(char *hostname, int portno, int timeout,
+    int rcvbuf, int sndbuf);
 int open_listenfd(int portno);
+int open_listenfd_reuseport(int portno);
 
 /* Wrappers for client/server helper functions */
 int Open_clientfd(char *hostname, int port);
 int Open_clientfd_r(char *hostname, int port);
 int Open_listenfd(int port); 
+int Open_listenfd_reuseport(int port);
+
+/* Hashing */
+uint64_t fnv1a_hash(const char *s);
+
+/* Parsing */
+long parse_size(char *spec);
 
 #endif /* __CSAPP_H__ */
 /* $end csapp.h */
@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include "http.h"
+
+#define MAXHDR 256
+
+/* hop-by-hop headers, and those the cache writes itself */
+static const char *http_hop[] = {"Connection", "Keep-Alive",
+    "Proxy-Connection", "Proxy-Authenticate", "Proxy-Authorization", "TE",
+    "Trailer", "Upgrade", "Age", "X-Cache", NULL};
+
+/* return the length of the header block, 0 if incomplete */
+size_t http_header_len(const char *buf, size_t len) {
+    size_t i;
+
+    for (i = 0; i + 3 < len; i++) {
+        if (buf[i] == '\r' && buf[i + 1] == '\n' &&
+            buf[i + 2] == '\r' && buf[i + 3] == '\n') {
+            return i + 4;
+        }
+    }
+    return 0;
+}
+
+/* copy the value of header name into value */
+int http_get_header(const char *hdrs, size_t len, const char *name,
+    char *value, size_t maxlen) {
+
+    size_t namelen = strlen(name);
+    const char *end = hdrs + len;
+    const char *line = hdrs;
+
+    while (line < end) {
+        const char *eol = memchr(line, '\n', end - line);
+        if (eol == NULL) {
+            eol = end;
+        }
+
+        /* the first line is the request/status line and never matches */
+        if (line != hdrs && line + namelen < eol &&
+            line[namelen] == ':' && !strncasecmp(line, name, namelen)) {
+            const char *p = line + namelen + 1;
+            size_t n;
+
+            while (p < eol && (*p == ' ' || *p == '\t')) {
+                p++;
+            }
+            n = eol - p;
+            if (n > 0 && p[n - 1] == '\r') {
+                n--;
+            }
+            if (n >= maxlen) {
+                n = maxlen - 1;
+            }
+            memcpy(value, p, n);
+            value[n] = '\0';
+            return 1;
+        }
+
+        line = eol + 1;
+    }
+    return 0;
+}
+
+/* return 1 if the n characters of name are a token of the list */
+static int http_listed(const char *list, const char *name, size_t n) {
+    while (*list) {
+        size_t len;
+
+        while (*list == ' ' || *list == '\t' || *list == ',') {
+            list++;
+        }
+        len = strcspn(list, " \t,");
+        if (len == n && !strncasecmp(list, name, n)) {
+            return 1;
+        }
+        list += len;
+    }
+    return 0;
+}
+
+/* rewrite a response header block for serving it from the cache */
+size_t http_cache_header(const char *hdrs, size_t len, char *out,
+    size_t *age_at, long *age) {
+
+    char connection[MAXHDR], value[MAXHDR];
+    const char *end = hdrs + len - 2, *line, *eol;
+    int dated = 0, drop = 0, i;
+    size_t n;
+    struct tm tm;
+    time_t now;
+
+    if (len < 4 || http_header_len(hdrs, len) != len) {
+        return 0;
+    }
+    *age = 0;
+    if (http_get_header(hdrs, len, "Age", value, MAXHDR) &&
+        (*age = strtol(value, NULL, 10)) < 0) {
+        *age = 0;
+    }
+    if (!http_get_header(hdrs, len, "Connection", connection, MAXHDR)) {
+        connection[0] = '\0';
+    }
+
+    /* the status line, then every header line but those dropped, a
+     * continuation line going with the line it continues */
+    eol = memchr(hdrs, '\n', len);
+    n = eol + 1 - hdrs;
+    memcpy(out, hdrs, n);
+    for (line = eol + 1; line < end; line = eol + 1) {
+        if ((eol = memchr(line, '\n', end - line)) == NULL) {
+            eol = end - 1;
+        }
+        if (*line != ' ' && *line != '\t') {
+            const char *colon = memchr(line, ':', eol - line);
+            size_t namelen = colon ? colon - line : 0;
+
+            drop = colon && http_listed(connection, line, namelen);
+            for (i = 0; colon && !drop && http_hop[i] != NULL; i++) {
+                drop = (strlen(http_hop[i]) == namelen &&
+                    !strncasecmp(line, http_hop[i], namelen));
+            }
+            if (colon && namelen == 4 && !strncasecmp(line, "Date", 4)) {
+                dated = 1;
+            }
+        }
+        if (!drop) {
+            memcpy(out + n, line, eol + 1 - line);
+            n += eol + 1 - line;
+        }
+    }
+
+    /* a response without Date gets the time it was received */
+    if (!dated) {
+        now = time(NULL);
+        gmtime_r(&now, &tm);
+        n += strftime(out + n, HTTP_CACHE_EXTRA,
+            "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+    }
+    memcpy(out + n, "Age: ", 5);
+    n += 5;
+    *age_at = n;
+    memset(out + n, ' ', HTTP_AGE_WIDTH);
+    out[n] = '0';
+    n += HTTP_AGE_WIDTH;
+    memcpy(out + n, "\r\nX-Cache: HIT\r\n\r\n", 18);
+    return n + 18;
+}
+
+/* return the status code of the response */
+int http_status(const char *buf, size_t len) {
+    int major, minor, status;
+    char line[32];
+
+    if (len >= sizeof(line)) {
+        len = sizeof(line) - 1;
+    }
+    memcpy(line, buf, len);
+    line[len] = '\0';
+
+    if (sscanf(line, "HTTP/%d.%d %d", &major, &minor, &status) != 3) {
+        return -1;
+    }
+    return status;
+}
+
+/* return the length of the complete entity */
+long http_entity_length(const char *hdrs, size_t len, long *start) {
+    char value[MAXHDR];
+    long first, last, total;
+
+    *start = 0;
+    if (http_status(hdrs, len) == 206) {
+        /* Content-Range: bytes first-last/total */
+        if (!http_get_header(hdrs, len, "Content-Range", value, MAXHDR) ||
+            sscanf(value, "bytes %ld-%ld/%ld", &first, &last, &total) != 3) {
+            return -1;
+        }
+        *start = first;
+        return total;
+    }
+
+    if (!http_get_header(hdrs, len, "Content-Length", value, MAXHDR)) {
+        return -1;
+    }
+    total = strtol(value, NULL, 10);
+    return (total < 0) ? -1 : total;
+}
+
+/* parse a single byte range */
+int http_parse_range(const char *value, long total, long *first, long *last) {
+    char *end;
+
+    if (strncasecmp(value, "bytes=", 6) || strchr(value, ',') != NULL) {
+        return 0;
+    }
+    value += 6;
+
+    if (*value == '-') {
+        /* suffix range: the last n bytes */
+        long n = strtol(value + 1, &end, 10);
+        if (end == value + 1 || *end != '\0') {
+            return 0;
+        }
+        if (total < 0) {
+            return 0;
+        }
+        if (n <= 0 || total == 0) {
+            return -1;
+        }
+        *first = (n > total) ? 0 : total - n;
+        *last = total - 1;
+        return 1;
+    }
+
+    *first = strtol(value, &end, 10);
+    if (end == value || *end != '-' || *first < 0) {
+        return 0;
+    }
+    value = end + 1;
+    if (*value == '\0') {
+        *last = -1;
+    }
+    else {
+        *last = strtol(value, &end, 10);
+        if (*end != '\0' || *last < *first) {
+            return 0;
+        }
+    }
+
+    if (total >= 0) {
+        if (*first >= total) {
+            return -1;
+        }
+        if (*last < 0 || *last >= total) {
+            *last = total - 1;
+        }
+    }
+    return 1;
+}
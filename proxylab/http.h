@@ -0,0 +1,63 @@
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include <stddef.h>
+
+/* helpers for looking into raw HTTP messages kept by the proxy */
+
+/* characters of the Age value http_cache_header() leaves room for */
+#define HTTP_AGE_WIDTH 10
+
+/* bytes http_cache_header() may add to a header block */
+#define HTTP_CACHE_EXTRA 128
+
+/*
+ * return the length of the header block in buf, including the empty
+ * line that terminates it
+ * return 0 if buf does not contain a complete header block
+ */
+size_t http_header_len(const char *buf, size_t len);
+
+/*
+ * look for header name (case insensitive) in the first len bytes of hdrs
+ * copy its value without leading blanks and trailing CRLF into value
+ * return 1 if found, 0 otherwise
+ */
+int http_get_header(const char *hdrs, size_t len, const char *name,
+    char *value, size_t maxlen);
+
+/*
+ * rewrite the header block of a response, len bytes of hdrs, into out
+ * (len + HTTP_CACHE_EXTRA bytes) for serving it from the cache: drop the
+ * hop-by-hop headers, those Connection names included, add a Date if
+ * there is none, and end with an Age value of HTTP_AGE_WIDTH characters,
+ * "0" padded with blanks, and X-Cache: HIT
+ * return the length of the new block, the offset of the Age value in it
+ * in *age_at and the Age the response came with in *age
+ * return 0 if hdrs is not a complete header block
+ */
+size_t http_cache_header(const char *hdrs, size_t len, char *out,
+    size_t *age_at, long *age);
+
+/* return the status code of the response in buf, -1 if malformed */
+int http_status(const char *buf, size_t len);
+
+/*
+ * return the length of the complete entity described by a response
+ * header block, taken from Content-Range for 206 responses and from
+ * Content-Length otherwise; return -1 if unknown
+ * the offset of the first body byte is stored in *start
+ */
+long http_entity_length(const char *hdrs, size_t len, long *start);
+
+/*
+ * parse a single "bytes=first-last" range (also "first-" and "-suffix")
+ * against an entity of total bytes, total < 0 if not known yet
+ * return 1 and the inclusive bounds on success, last is -1 if it
+ * cannot be resolved without total
+ * return 0 if the range should be ignored (malformed or multi range)
+ * return -1 if the range is not satisfiable
+ */
+int http_parse_range(const char *value, long total, long *first, long *last);
+
+#endif
@@ -0,0 +1,60 @@
+/*
+ * logdump - print a binary access log of the proxy as text
+ *
+ * logdump <logfile>
+ *     one line per request: start time, client address, status, where
+ *     the response came from, bytes sent, latency in ms and the hash
+ *     of the request URI
+ *
+ * The log is written by the proxy started with -g, see accesslog.h.
+ */
+
+#include "csapp.h"
+#include "accesslog.h"
+
+static char *sources[] = {"-", "HIT", "MISS", "TUNNEL", "PEER"};
+
+/* print rec as one line of text */
+static void dump(log_record *rec) {
+    char client[INET_ADDRSTRLEN], date[32];
+    time_t secs = rec->time / 1000000;
+    struct tm tm;
+
+    inet_ntop(AF_INET, &rec->client, client, INET_ADDRSTRLEN);
+    gmtime_r(&secs, &tm);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &tm);
+
+    printf("%s.%06luZ %s %u %s %lu %.3f %016lx\n", date,
+        (unsigned long)(rec->time % 1000000), client, rec->status,
+        rec->source < 5 ? sources[rec->source] : "?",
+        (unsigned long)rec->bytes, rec->latency / 1e3,
+        (unsigned long)rec->uri_hash);
+}
+
+int main(int argc, char **argv) {
+    char magic[8];
+    log_record rec;
+    ssize_t n;
+    rio_t rio;
+    int fd;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <logfile>\n", argv[0]);
+        exit(1);
+    }
+    fd = Open(argv[1], O_RDONLY, 0);
+    Rio_readinitb(&rio, fd);
+
+    if (Rio_readnb(&rio, magic, 8) != 8 || memcmp(magic, LOG_MAGIC, 8)) {
+        fprintf(stderr, "%s: not an access log\n", argv[1]);
+        exit(1);
+    }
+    while ((n = Rio_readnb(&rio, &rec, sizeof(rec))) == sizeof(rec)) {
+        dump(&rec);
+    }
+    if (n != 0) {
+        fprintf(stderr, "%s: truncated record at the end\n", argv[1]);
+    }
+    Close(fd);
+    return 0;
+}
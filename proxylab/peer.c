@@ -0,0 +1,134 @@
+#include <stdint.h>
+#include "csapp.h"
+#include "peer.h"
+
+/* a point of the ring */
+typedef struct {
+    uint64_t hash;
+    int peer;                   //index into peers
+} vnode_t;
+
+static peer_t *peers;
+static int npeers;
+static int self = -1;           //index of this proxy in peers, or -1
+static vnode_t *ring;           //npeers * PEER_VNODES points by hash
+static int nring;
+
+/* fnv1a_hash() of s, mixed so that similar strings land far apart */
+static uint64_t peer_hash(const char *s) {
+    uint64_t h = fnv1a_hash(s);
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdUL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53UL;
+    h ^= h >> 33;
+    return h;
+}
+
+static int vnode_cmp(const void *a, const void *b) {
+    uint64_t x = ((vnode_t *)a)->hash, y = ((vnode_t *)b)->hash;
+
+    return (x > y) - (x < y);
+}
+
+/* return 1 if host:port names this proxy */
+static int peer_is_self(char *host, int peer_port, int port) {
+    char name[MAXLINE];
+
+    if (peer_port != port) {
+        return 0;
+    }
+    if (!strcmp(host, "localhost") || !strcmp(host, "127.0.0.1")) {
+        return 1;
+    }
+    return gethostname(name, MAXLINE) == 0 && !strcasecmp(host, name);
+}
+
+/* parse the peers and build the ring */
+int peer_init(char *spec, int port) {
+    char *list, *entry, *save, *colon, key[MAXLINE];
+    int i, j;
+
+    if ((list = strdup(spec)) == NULL) {
+        return -1;
+    }
+    for (entry = strtok_r(list, ",", &save); entry != NULL;
+        entry = strtok_r(NULL, ",", &save)) {
+        peer_t *p;
+
+        if ((colon = strrchr(entry, ':')) == NULL || colon == entry ||
+            atoi(colon + 1) <= 0 || strlen(entry) > MAXLINE / 2) {
+            free(list);
+            return -1;
+        }
+        *colon = '\0';
+        if ((p = realloc(peers, (npeers + 1) * sizeof(peer_t))) == NULL) {
+            free(list);
+            return -1;
+        }
+        peers = p;
+        peers[npeers].host = strdup(entry);
+        peers[npeers].port = atoi(colon + 1);
+        peers[npeers].down_until = 0;
+        if (self < 0 && peer_is_self(entry, peers[npeers].port, port)) {
+            self = npeers;
+        }
+        npeers++;
+    }
+    free(list);
+    if (npeers == 0) {
+        return -1;
+    }
+
+    /* the points of a peer hang off its host:port, the same in every
+     * proxy of the fleet */
+    ring = Malloc(npeers * PEER_VNODES * sizeof(vnode_t));
+    for (i = 0; i < npeers; i++) {
+        for (j = 0; j < PEER_VNODES; j++) {
+            sprintf(key, "%s:%d#%d", peers[i].host, peers[i].port, j);
+            ring[nring].hash = peer_hash(key);
+            ring[nring++].peer = i;
+        }
+    }
+    qsort(ring, nring, sizeof(vnode_t), vnode_cmp);
+    return 0;
+}
+
+/* the peer owning uri, NULL if it is this proxy */
+peer_t *peer_owner(char *uri) {
+    uint64_t h;
+    int lo = 0, hi, owner;
+    peer_t *p;
+
+    if (nring == 0) {
+        return NULL;
+    }
+
+    /* binary search for the first point at or after h, wrapping around */
+    h = peer_hash(uri);
+    hi = nring;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ring[mid].hash < h) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    owner = ring[lo == nring ? 0 : lo].peer;
+
+    p = &peers[owner];
+    if (owner == self ||
+        rio_clock() < __atomic_load_n(&p->down_until, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    return p;
+}
+
+/* pass over a peer for a while */
+void peer_failed(peer_t *peer) {
+    __atomic_store_n(&peer->down_until, rio_clock() + PEER_RETRY,
+        __ATOMIC_RELAXED);
+}
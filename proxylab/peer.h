@@ -0,0 +1,50 @@
+#ifndef __PEER_H__
+#define __PEER_H__
+
+/*
+ * cache sharing between a fleet of proxies by consistent hashing
+ *
+ * Every proxy of the fleet is given the same list of peers, itself
+ * included. Each peer stands for PEER_VNODES points on a hash ring and
+ * a URI is owned by the peer of the first point at or after the hash
+ * of the URI, so every proxy agrees on the owner and a peer joining or
+ * leaving the list moves only the URIs next to its points. A proxy
+ * sends a miss of a URI it does not own to the owner rather than to
+ * the origin and does not cache the response, so an object is cached
+ * once in the fleet instead of once per proxy.
+ *
+ * A peer that cannot be reached is passed over for PEER_RETRY ms; its
+ * URIs go to their origins meanwhile.
+ */
+
+#define PEER_VNODES 64          //ring points per peer
+#define PEER_RETRY 5000         //ms a failed peer is passed over
+
+/* request header marking a request sent by a peer, never forwarded */
+#define PEER_HDR "X-Proxy-Peer"
+
+/* a proxy of the fleet */
+typedef struct {
+    char *host;
+    int port;
+    long down_until;            //rio_clock() time it may be tried again
+} peer_t;
+
+/*
+ * set up the ring from a comma separated list of host:port peers; the
+ * peer at localhost, 127.0.0.1 or the host name with port is this
+ * proxy, which owns nothing if the list leaves it out
+ * return -1 if spec is malformed
+ */
+int peer_init(char *spec, int port);
+
+/*
+ * return the peer owning uri, NULL if this proxy owns it, there are no
+ * peers, or the owner failed less than PEER_RETRY ms ago
+ */
+peer_t *peer_owner(char *uri);
+
+/* pass over a peer that could not be reached for PEER_RETRY ms */
+void peer_failed(peer_t *peer);
+
+#endif
@@ -0,0 +1,237 @@
+#include <ctype.h>
+#include "csapp.h"
+#include "http.h"
+#include "sbuf.h"
+#include "prefetch.h"
+
+#define PREFETCH_QUEUE 256      //URIs waiting for a worker
+
+static sbuf_t queue;
+static int budget;              //URIs queued per page, 0 if disabled
+static void (*fetch_fn)(char *uri);
+
+/* worker thread: fetch queued URIs for ever */
+static void *prefetch_worker(void *vargp) {
+    Pthread_detach(pthread_self());
+
+    while (1) {
+        char *uri = sbuf_remove(&queue);
+        fetch_fn(uri);
+        free(uri);
+    }
+    return NULL;
+}
+
+/* start the workers */
+void prefetch_init(int workers, int per_page, void (*fetch)(char *uri)) {
+    pthread_t tid;
+    int i;
+
+    sbuf_init(&queue, PREFETCH_QUEUE);
+    fetch_fn = fetch;
+    for (i = 0; i < workers; i++) {
+        Pthread_create(&tid, NULL, prefetch_worker, NULL);
+    }
+    budget = per_page;
+}
+
+/* parse "workers:budget" */
+int prefetch_parse(char *spec, int *workers, int *per_page) {
+    char extra;
+
+    if (sscanf(spec, "%d:%d%c", workers, per_page, &extra) != 2 ||
+        *workers <= 0 || *per_page <= 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/* length of the "http://host[:port]" origin of uri, 0 if it has none */
+static size_t prefetch_origin(const char *uri) {
+    if (strncasecmp(uri, "http://", 7)) {
+        return 0;
+    }
+    return 7 + strcspn(uri + 7, "/?#");
+}
+
+/*
+ * resolve the link of len bytes found on page into out (MAXLINE bytes)
+ * return 0 if it names a resource of the page's origin, -1 otherwise
+ */
+static int prefetch_resolve(char *page, size_t origin_len,
+    char *link, size_t len, char *out) {
+
+    char ref[MAXLINE];
+    char *dir = page + origin_len;
+    size_t dir_len;
+    int n;
+
+    if (len == 0 || len >= MAXLINE) {
+        return -1;
+    }
+    memcpy(ref, link, len);
+    ref[len] = '\0';
+    ref[strcspn(ref, "#")] = '\0';
+
+    if (ref[0] == '\0') {
+        return -1;
+    }
+    else if (!strncasecmp(ref, "http://", 7)) {
+        n = snprintf(out, MAXLINE, "%s", ref);
+    }
+    else if (ref[0] == '/' && ref[1] == '/') {
+        /* same scheme, another host maybe */
+        n = snprintf(out, MAXLINE, "http:%s", ref);
+    }
+    else if (ref[0] == '/') {
+        n = snprintf(out, MAXLINE, "%.*s%s", (int)origin_len, page, ref);
+    }
+    else if (strcspn(ref, ":") < strcspn(ref, "/?")) {
+        /* another scheme: https:, data:, javascript:, mailto: */
+        return -1;
+    }
+    else {
+        /* relative to the directory of the page */
+        char *rel = ref;
+
+        while (!strncmp(rel, "./", 2)) {
+            rel += 2;
+        }
+        dir_len = strcspn(dir, "?#");
+        while (dir_len > 0 && dir[dir_len - 1] != '/') {
+            dir_len--;
+        }
+        if (dir_len == 0) {
+            n = snprintf(out, MAXLINE, "%.*s/%s", (int)origin_len, page, rel);
+        }
+        else {
+            n = snprintf(out, MAXLINE, "%.*s%.*s%s", (int)origin_len, page,
+                (int)dir_len, dir, rel);
+        }
+    }
+
+    if (n >= MAXLINE || prefetch_origin(out) != origin_len ||
+        strncasecmp(out, page, origin_len)) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * queue the resource a link points to
+ * return -1 once the queue is full
+ */
+static int prefetch_queue(char *page, size_t origin_len, char *link,
+    size_t len, unsigned long *seen, int *nseen) {
+
+    char uri[MAXLINE];
+    unsigned long h;
+    char *copy;
+    int i;
+
+    if (prefetch_resolve(page, origin_len, link, len, uri) < 0 ||
+        !strcmp(uri, page)) {
+        return 0;
+    }
+    h = fnv1a_hash(uri);
+    for (i = 0; i < *nseen; i++) {
+        if (seen[i] == h) {
+            return 0;
+        }
+    }
+    if ((copy = strdup(uri)) == NULL) {
+        return -1;
+    }
+    if (sbuf_tryinsert(&queue, copy) < 0) {
+        free(copy);
+        return -1;
+    }
+    seen[(*nseen)++] = h;
+    return 0;
+}
+
+/* scan an HTML page for resources to prefetch */
+void prefetch_scan(char *uri, char *object, size_t size) {
+    char type[MAXLINE];
+    size_t hdr_len, origin_len;
+    char *p, *end = object + size;
+    unsigned long *seen;
+    int nseen = 0, full = 0;
+
+    if (!budget || (origin_len = prefetch_origin(uri)) == 0 ||
+        (hdr_len = http_header_len(object, size)) == 0) {
+        return;
+    }
+    if (!http_get_header(object, hdr_len, "Content-Type", type, MAXLINE) ||
+        strncasecmp(type, "text/html", 9)) {
+        return;
+    }
+    if ((seen = malloc(budget * sizeof(unsigned long))) == NULL) {
+        return;
+    }
+
+    p = object + hdr_len;
+    while (!full && nseen < budget && (p = memchr(p, '<', end - p)) != NULL) {
+        char *tag = ++p;
+        int is_link;
+
+        while (p < end && isalnum((unsigned char)*p)) {
+            p++;
+        }
+        is_link = (p - tag == 4 && !strncasecmp(tag, "link", 4));
+
+        /* name=value attributes up to the end of the tag */
+        while (!full && nseen < budget && p < end && *p != '>') {
+            char *name, *value;
+            size_t name_len, value_len;
+
+            while (p < end && isspace((unsigned char)*p)) {
+                p++;
+            }
+            name = p;
+            while (p < end && !isspace((unsigned char)*p) &&
+                *p != '=' && *p != '>') {
+                p++;
+            }
+            name_len = p - name;
+            while (p < end && isspace((unsigned char)*p)) {
+                p++;
+            }
+            if (p == end || *p != '=') {
+                if (name_len == 0 && p < end && *p != '>') {
+                    p++;
+                }
+                continue;
+            }
+            p++;
+            while (p < end && isspace((unsigned char)*p)) {
+                p++;
+            }
+            if (p < end && (*p == '"' || *p == '\'')) {
+                char quote = *p++;
+                value = p;
+                while (p < end && *p != quote) {
+                    p++;
+                }
+                value_len = p - value;
+                if (p < end) {
+                    p++;
+                }
+            }
+            else {
+                value = p;
+                while (p < end && !isspace((unsigned char)*p) && *p != '>') {
+                    p++;
+                }
+                value_len = p - value;
+            }
+
+            if ((name_len == 3 && !strncasecmp(name, "src", 3)) ||
+                (is_link && name_len == 4 && !strncasecmp(name, "href", 4))) {
+                full = prefetch_queue(uri, origin_len, value, value_len,
+                    seen, &nseen) < 0;
+            }
+        }
+    }
+    free(seen);
+}
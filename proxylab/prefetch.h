@@ -0,0 +1,35 @@
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+#include <stddef.h>
+
+/*
+ * prefetching of the resources embedded in cached HTML pages
+ *
+ * When a page is cached, its body is scanned for the src attribute of
+ * any tag and the href of <link> tags that point to the page's own
+ * origin. Up to budget of those URIs per page are queued for a pool of
+ * background workers that fetch them into the cache, so the image and
+ * script requests following the page are hits. Queueing never blocks:
+ * URIs that do not fit into the queue are dropped.
+ */
+
+/*
+ * start workers threads that each take a queued URI and call fetch on
+ * it; fetch is expected to skip URIs that are cached already
+ */
+void prefetch_init(int workers, int budget, void (*fetch)(char *uri));
+
+/*
+ * parse a "workers:budget" option for prefetch_init()
+ * return -1 if spec is malformed
+ */
+int prefetch_parse(char *spec, int *workers, int *budget);
+
+/*
+ * queue the same-origin resources of the response object cached under
+ * uri if it is an HTML page; does nothing before prefetch_init()
+ */
+void prefetch_scan(char *uri, char *object, size_t size);
+
+#endif
@@ -10,15 +10,46 @@
  */ 
 
 #include <stdio.h>
+#include <poll.h>
+#include <sys/prctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/tcp.h>
 #include "csapp.h"
 #include "cache.h"
-
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE (1 << 20)
-#define MAX_OBJECT_SIZE 102400
+#include "http.h"
+#include "tunnel.h"
+#include "ratelimit.h"
+#include "uring.h"
+#include "coro.h"
+#include "prefetch.h"
+#include "sbuf.h"
+#include "proxy.h"
+#include "bufpool.h"
+#include "peer.h"
 
 #define DEFAULT_PORT 80
 
+/* objects too large for the cache are kept as chunks of this size */
+#define CHUNK_SIZE (1 << 15)
+#define MAX_RANGE_CHUNKS 64
+#define CHUNK_KEYLEN (MAXLINE + 32)
+
+/* connections an accept loop takes per wakeup at most */
+#define ACCEPT_BATCH 64
+
+/* longer Range headers are ignored and the whole object is sent */
+#define MAX_RANGE 256
+
+/* reads of a response body from a server are at most this large */
+#define RELAY_MAX (128 * 1024)
+
+/* the request and response header blocks a connection may grow to */
+#define MAX_HDR (64 * 1024)
+
+/* room for the standard headers written by stdHdr() */
+#define STD_HDR_LEN 512
+
 /* You won't lose style points for including these long lines in your code */
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
 static const char *accept_hdr = "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n";
@@ -28,6 +59,16 @@ static const char *proxy_conn_hdr = "Proxy-Connection: close";
 
 /* inline helper functions */
 
+/* write the standard headers of every request to a server into buf */
+inline static int stdHdr(char *buf) {
+    return sprintf(buf, "%s%s%s\r\n%s\r\n%s\r\n",
+        user_agent_hdr,
+        accept_hdr,
+        accept_encoding_hdr,
+        conn_hdr,
+        proxy_conn_hdr);
+}
+
 /* 
  * return 1 if is not standard headers
  * return 0 if it's any one of them
@@ -40,190 +81,2261 @@ inline static int isUnknownHdr(char *buf){
         strncmp(buf, "Proxy-Connection", 16));
 }
 
-/* construct a header for the request to sever with client header info */
-inline static void requestHdr(rio_t *rio_ptr, 
-    char *request_buf, char *host, char *filename){
+/* a request that missed the cache, on its way to the server */
+typedef struct {
+    conn_t *conn;
+    long deadline;              //rio_clock() time the request gives up
+    int port;
+    char *uri;                  //uri, host and request_buf come from the
+    char *host;                 //buffer pool, as does the miss_t itself
+    char *request_buf;          //request for the server, without Range
+    size_t request_len;
+    char range[MAX_RANGE];      //the client's Range, not forwarded as is
+    int from_peer;              //sent by a peer, fetched from the origin
+} miss_t;
 
-    char get_cmd[MAXLINE], host_hdr[MAXLINE], std_hdr[MAXLINE], append_hdr[MAXLINE];
-    char buf[MAXLINE];
+/*
+ * append n bytes of s to the request for the server
+ * return -1 if out of memory
+ */
+static int requestAppend(miss_t *req, const char *s, size_t n) {
+    char *grown = buf_grow(req->request_buf, req->request_len + n + 1);
 
-    /* construct get request header */
-    sprintf(get_cmd, "GET %s HTTP/1.0\r\n", filename);
+    if (grown == NULL) {
+        return -1;
+    }
+    req->request_buf = grown;
+    memcpy(grown + req->request_len, s, n);
+    req->request_len += n;
+    grown[req->request_len] = '\0';
+    return 0;
+}
+
+/*
+ * construct a header for the request to sever with client header info
+ * the request grows in a pooled buffer as the client's headers are read
+ * into line (MAXLINE bytes); unknown headers past MAX_HDR are dropped
+ * the client's Range header is not forwarded but stored into req->range,
+ * the caller adds the Range it wants and the terminating empty line
+ * return -1 if the client's headers could not be read in full
+ */
+static int requestHdr(rio_t *rio_ptr, miss_t *req, char *filename,
+    char *line) {
 
-    /* construct headers for the host and suffix part */
-    strcpy(host_hdr, "");
+    char std_hdr[STD_HDR_LEN];
+    int has_host = 0;
+    ssize_t rc;
 
-    while (Rio_readlineb(rio_ptr, buf, MAXLINE) > 0) {
-        if (!strcmp(buf, "\r\n")) {
+    /* construct get request header */
+    req->request_len = 0;
+    req->range[0] = '\0';
+    req->from_peer = 0;
+    if (requestAppend(req, "GET ", 4) < 0 ||
+        requestAppend(req, filename, strlen(filename)) < 0 ||
+        requestAppend(req, " HTTP/1.0\r\n", 11) < 0) {
+        return -1;
+    }
+
+    /* the client's Host and unknown headers are kept in order */
+    while ((rc = rio_readlineb(rio_ptr, line, MAXLINE)) > 0) {
+        if (!strcmp(line, "\r\n")) {
             break;
         }
-        else if (!strncmp(buf, "Host:", 5)) {
-            strcpy(host_hdr, buf);
+        else if (!strncasecmp(line, "Range:", 6)) {
+            if (rc < MAX_RANGE) {
+                sscanf(line + 6, "%s", req->range);
+            }
+        }
+        else if (!strncasecmp(line, PEER_HDR ":", strlen(PEER_HDR) + 1)) {
+            req->from_peer = 1;
         }
-        else if (isUnknownHdr(buf)) {
-            strcat(append_hdr, buf);
+        else if (!strncmp(line, "Host:", 5) ||
+            (isUnknownHdr(line) && req->request_len + rc < MAX_HDR)) {
+            if (requestAppend(req, line, rc) < 0) {
+                return -1;
+            }
+            has_host |= !strncmp(line, "Host:", 5);
         }
     }
+    if (rc <= 0) {
+        return -1;
+    }
 
     /* if no host info in client header */
-    if (!strlen(host_hdr)) {
-        sprintf(host_hdr, "Host: %s\r\n", host);
+    if (!has_host && (requestAppend(req, "Host: ", 6) < 0 ||
+        requestAppend(req, req->host, strlen(req->host)) < 0 ||
+        requestAppend(req, "\r\n", 2) < 0)) {
+        return -1;
     }
 
     /* construct standard headers */
-    sprintf(std_hdr, "%s%s%s\r\n%s\r\n%s\r\n\r\n",
-        user_agent_hdr,
-        accept_hdr,
-        accept_encoding_hdr,
-        conn_hdr,
-        proxy_conn_hdr);
-
-    /* construct header for server */
-    sprintf(request_buf, "%s%s%s%s",
-        get_cmd,
-        host_hdr,
-        std_hdr,
-        append_hdr);
-
-    return;
+    return requestAppend(req, std_hdr, stdHdr(std_hdr));
 }
 
 /* Global pointer to cache base */
 cache *cache_ptr;
 
+/*
+ * timeouts in milliseconds, 0 disables them
+ * hdr_timeout bounds reading the client's request line and headers,
+ * conn_timeout connecting to a server, idle_timeout any single read or
+ * write, req_timeout the whole request
+ */
+static int hdr_timeout = 10000;
+static int conn_timeout = 5000;
+static int idle_timeout = 30000;
+static int req_timeout = 300000;
+
+/*
+ * socket tuning, see -b and -n
+ * upstream_rcvbuf is SO_RCVBUF of server sockets and client_sndbuf
+ * SO_SNDBUF of client sockets in bytes, 0 leaves them to the kernel's
+ * autotuning; tcp_nodelay sets TCP_NODELAY on both, tcp_cork corks a
+ * client socket while a response from a server is relayed to it, so
+ * its header and body leave in full segments
+ */
+static int upstream_rcvbuf = 0;
+static int client_sndbuf = 0;
+static int tcp_nodelay = 1;
+static int tcp_cork = 1;
+
+/* admission limits per client address and per upstream host */
+limiter *client_limit;
+limiter *host_limit;
+
+/* a listening socket and the CPU its accept loop is pinned to (-1 none) */
+typedef struct {
+    int listenfd;
+    int cpu;
+} acceptor_t;
+
+/* cache large objects in chunks and serve ranges from them */
+static int chunk_mode = 0;
+
+/* pooled buffers of a response being relayed, see relayResponse() */
+typedef struct {
+    char *buf;                  //header lines, then body reads sized by
+                                //relayGrow() up to RELAY_MAX
+    char *object;               //header block then body, grown as they come
+    size_t object_size;
+    char *chunk;                //CHUNK_SIZE bytes with chunk_mode, or NULL
+    size_t chunk_len;
+    char *key;                  //CHUNK_KEYLEN bytes along with chunk
+    int keep;                   //cache the response
+} relay_t;
+
+/*
+ * with -w, pools of workers replace the thread per connection: the
+ * accept loop reads the request headers of a connection without
+ * blocking, then a GET waits in hit_lane for a hit worker that answers
+ * it from the cache; misses wait in miss_lane for one of the miss
+ * workers, so neither slow clients nor slow servers hold up cache hits
+ * other methods get a thread of their own, as without -w
+ */
+#define LANE_QUEUE 1024
+#define LANE_SWEEP 1000         //ms between checks for stalled clients
+static int lanes = 0;
+static sbuf_t hit_lane;
+static sbuf_t miss_lane;
+
+/*
+ * stale objects are refreshed by a small pool started with the first
+ * refresh(); a refresh that finds the queue full is dropped, and the
+ * object is claimed again CACHE_REFRESH_RETRY ms later
+ */
+#define REFRESH_WORKERS 4
+#define REFRESH_QUEUE 64
+static sbuf_t refresh_lane;
+static pthread_once_t refresh_once = PTHREAD_ONCE_INIT;
+
+/* a connection whose request headers its accept loop is reading */
+typedef struct pending {
+    conn_t *conn;               //the headers go to conn->pre
+    rio_t rio;
+    long deadline;              //rio_clock() time it is dropped, 0 never
+    struct pending *prev, *next;
+} pending_t;
+
+/* I/O engines accepting and reading requests */
+#define ENGINE_THREAD 0         //blocking accept and a thread per connection
+#define ENGINE_URING 1          //io_uring loop serving hits, see uring.h
+#define ENGINE_CORO 2           //a coroutine per connection, see coro.h
+static int engine = ENGINE_THREAD;
+
+/*
+ * draining and hot reload, see proxy.h, signalThread() and reload()
+ * accepting counts the front ends that did not unlisten() yet, drain_ms
+ * bounds the wait for live connections (-d, 0 for ever); a new image
+ * finds what the one it replaces handed down in the ENV_* variables
+ */
+#define RELOAD_WAIT 10000       //ms a new image gets to announce it is ready
+#define DRAIN_POLL 50           //ms between checks of a draining process
+#define ENV_LISTEN "PROXY_HANDOVER_LISTEN"  //listening sockets, "3,4"
+#define ENV_CACHE "PROXY_HANDOVER_CACHE"    //segment of the shared cache
+#define ENV_READY "PROXY_HANDOVER_READY"    //pipe to write a byte to
+int draining;
+int drain_fd = -1;
+long live_conns;
+static int accepting;
+static long drain_ms = 30000;
+static int is_worker;           //a worker process of -P
+static char self_path[MAXLINE]; //the binary to exec() on SIGHUP
+static char **self_argv;
+static int ready_fd = -1;
+
+/* the listening sockets and the accept loop of each */
+static acceptor_t *acceptors;
+static int nlisten;
+
 /* helper function delaration */
+void usage(char *prog);
 int parse_uri(char *uri, char *host, int *port, char *suffix);
+void *acceptLoop(void *vargp);
+static int acceptBatch(int listenfd, int epfd, conn_t **batch, int max);
+static void dispatchBatch(conn_t **batch, int n, pthread_attr_t *attr);
+static void laneLoop(int listenfd, int epfd, pthread_attr_t *attr);
+static void pendingAdd(pending_t *head, int epfd, conn_t *conn);
+static int pendingRead(pending_t *p);
+static void pendingDone(pending_t *p, int epfd);
+static int laneTakes(conn_t *conn);
+static int startThread(conn_t *conn, pthread_attr_t *attr);
+static void tuneListener(int listenfd);
 void *doit(void *vargp);
+static void serveConn(conn_t *conn);
+static void releaseConn(conn_t *conn);
+static void lanesInit(int hit_workers, int miss_workers);
+static void *hitWorker(void *vargp);
+static void *missWorker(void *vargp);
+static int serve(conn_t *conn);
+static int readRequest(conn_t *conn, rio_t *rio, char *line, miss_t *req);
+static int serveGet(conn_t *conn, miss_t *req);
+static void missFree(miss_t *req);
+static char *hitObject(cache_block *block, char **decoded, size_t *size);
+static int missLane(miss_t *req);
+static void fetchMiss(miss_t *req);
+static int fetchPeer(miss_t *req, peer_t *peer, int ranged);
+static void refuse(int fd, char *cause, int reason);
+static void connectError(int fd, char *host, int port, char *errnum,
+    char *shortmsg);
+static void setTimeouts(int fd, int read_ms);
+static int parseTimeouts(char *spec);
+static int parseBufs(char *spec);
+static int openServer(char *host, int port);
+static void setCork(int fd, int on);
+static void *signalThread(void *vargp);
+static void drain(void);
+static int reload(void);
+static int inherit(int **fds, int *cache_fd);
+static void announceReady(void);
+static void preforkWorkers(int nprocs);
+static pid_t forkWorker(void);
+static int connectTunnel(int fd, rio_t *rio, char *uri, char *line,
+    log_record *rec);
+static void serveObject(int fd, cache_block *block, char *object,
+    size_t size, char *range, log_record *rec);
+static int serveChunks(int fd, char *uri, char *range, log_record *rec);
+static void relayResponse(int fd, rio_t *rio, char *uri, char *range,
+    int ranged, int keep, log_record *rec);
+static int relayKeep(relay_t *relay, char *data, size_t n);
+static void relayGrow(relay_t *relay, long size);
+static void relayStream(int fd, rio_t *rio, char *uri, char *range,
+    int ranged, relay_t *relay, log_record *rec);
+static void prefetchFetch(char *uri);
+static void refreshInit(void);
+static void *refreshWorker(void *vargp);
+static void fetchObject(char *uri);
 void printerror(int fd, char *cause, char *errnum,
     char *shortmsg, char *longmsg);
 
 
 /* ----------------- main routine of web proxy ----------------- */
 int main(int argc, char *argv[]) {
-    int listenfd, *connfd, port, clientlen;
-    struct sockaddr_in clientaddr;
+    int port, i;
     pthread_t pid;
 
+    int opt, compress = 0, nacceptors = 0, pin = 0;
+    int hit_workers = 0, miss_workers = 0;
+    int prefetch_workers = 0, prefetch_budget = 0, nprocs = 0;
+    int pages = -1, ninherited, *inherited, cache_fd;
+    char *peers = NULL;
+    double ttl = 0, stale = 0;
+    long budget = MAX_CACHE_SIZE;
+    ssize_t len;
+    sigset_t sigs;
+
+    /*
+     * SIGUSR2, SIGTERM and SIGHUP are taken by signalThread, or by the
+     * master of -P, every thread inherits the mask
+     */
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGUSR2);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+    /* what a SIGHUP runs again, and what the image before handed down */
+    if ((len = readlink("/proc/self/exe", self_path, MAXLINE - 1)) > 0) {
+        self_path[len] = '\0';
+    }
+    else {
+        snprintf(self_path, MAXLINE, "%s", argv[0]);
+    }
+    self_argv = argv;
+    ninherited = inherit(&inherited, &cache_fd);
+
     /* Check command line args */
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
-        exit(1);
+    while ((opt = getopt(argc, argv, "zcl:L:t:a:pe:f:w:g:s:m:H:P:b:n:r:d:")) != -1) {
+        if (opt == 'z') {
+            /* keep text-like objects compressed in the cache */
+            compress = 1;
+        }
+        else if (opt == 'c') {
+            /* cache large objects in chunks for range requests */
+            chunk_mode = 1;
+        }
+        else if (opt == 'l') {
+            /* rate:burst:inflight limits per client address */
+            if ((client_limit = limiter_parse(optarg)) == NULL) {
+                usage(argv[0]);
+            }
+        }
+        else if (opt == 'L') {
+            /* rate:burst:inflight limits per upstream host */
+            if ((host_limit = limiter_parse(optarg)) == NULL) {
+                usage(argv[0]);
+            }
+        }
+        else if (opt == 't') {
+            /* header:connect:idle:total timeouts in seconds */
+            if (parseTimeouts(optarg) < 0) {
+                usage(argv[0]);
+            }
+        }
+        else if (opt == 'a') {
+            /* accept threads with a SO_REUSEPORT listener each */
+            if ((nacceptors = atoi(optarg)) <= 0) {
+                usage(argv[0]);
+            }
+        }
+        else if (opt == 'p') {
+            /* pin each accept thread and its connections to a CPU */
+            pin = 1;
+        }
+        else if (opt == 'e') {
+            /* I/O engine */
+            if (!strcmp(optarg, "thread")) {
+                engine = ENGINE_THREAD;
+            }
+            else if (!strcmp(optarg, "uring")) {
+                engine = ENGINE_URING;
+            }
+            else if (!strcmp(optarg, "coro")) {
+                engine = ENGINE_CORO;
+            }
+            else {
+                usage(argv[0]);
+            }
+        }
+        else if (opt == 'w') {
+            /* hit:miss worker pools instead of a thread per connection */
+            if (sscanf(optarg, "%d:%d", &hit_workers, &miss_workers) != 2 ||
+                hit_workers <= 0 || miss_workers <= 0) {
+                usage(argv[0]);
+            }
+        }
+        else if (opt == 's') {
+            /* ttl:stale seconds objects stay fresh and are served stale */
+            if (sscanf(optarg, "%lf:%lf", &ttl, &stale) < 1 ||
+                ttl < 0 || stale < 0) {
+                usage(argv[0]);
+            }
+        }
+        else if (opt == 'm') {
+            /* bytes the cache may allocate, metadata included */
+            if ((budget = parse_size(optarg)) <= 0) {
+                usage(argv[0]);
+            }
+        }
+        else if (opt == 'H') {
+            /* pages of an arena holding the cached objects */
+            if ((pages = cache_pages_parse(optarg)) < 0) {
+                usage(argv[0]);
+            }
+        }
+        else if (opt == 'b') {
+            /* SO_RCVBUF of server and SO_SNDBUF of client sockets */
+            if (parseBufs(optarg) < 0) {
+                usage(argv[0]);
+            }
+        }
+        else if (opt == 'n') {
+            /* TCP_NODELAY and TCP_CORK on or off */
+            if (sscanf(optarg, "%d:%d", &tcp_nodelay, &tcp_cork) != 2) {
+                usage(argv[0]);
+            }
+        }
+        else if (opt == 'r') {
+            /* peers sharing their caches, set up once the port is known */
+            peers = optarg;
+        }
+        else if (opt == 'd') {
+            /* seconds a draining process waits for its connections */
+            if ((drain_ms = atoi(optarg) * 1000L) < 0) {
+                usage(argv[0]);
+            }
+        }
+        else if (opt == 'P') {
+            /* worker processes sharing a cache in shared memory */
+            if ((nprocs = atoi(optarg)) <= 0) {
+                usage(argv[0]);
+            }
+        }
+        else if (opt == 'g') {
+            /* binary access log, see accesslog.h */
+            if (accesslog_open(optarg) < 0) {
+                unix_error("accesslog_open error");
+            }
+        }
+        else if (opt == 'f') {
+            /* workers:budget prefetching resources of cached pages */
+            if (prefetch_parse(optarg, &prefetch_workers, &prefetch_budget) < 0) {
+                usage(argv[0]);
+            }
+        }
+        else {
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 1) {
+        usage(argv[0]);
     }
 
-    /* init cache */
+    /* a client or server going away only fails that connection */
+    Signal(SIGPIPE, SIG_IGN);
+
+    /* the io_uring loop reports its counters on SIGUSR1, see uring.h */
+    Signal(SIGUSR1, SIG_IGN);
+
+    /* init cache, in shared memory for the worker processes */
     cache_ptr = cache_init();
+    cache_ptr->compress = compress;
+    cache_ptr->ttl = ttl * 1000;
+    cache_ptr->stale = stale * 1000;
+    cache_ptr->budget = budget;
+    if (cache_fd >= 0 && (!nprocs || cache_attach(cache_ptr, cache_fd) < 0)) {
+        /* the cache handed down is of no use to this image */
+        fprintf(stderr, "starting with an empty cache\n");
+        close(cache_fd);
+        cache_fd = -1;
+    }
+    if (nprocs && cache_fd < 0 && cache_share(cache_ptr) < 0) {
+        unix_error("cache_share error");
+    }
+    if (pages >= 0 && cache_arena(cache_ptr, pages) < 0) {
+        unix_error("cache_arena error");
+    }
 
     /* listen to port */
-    port = atoi(argv[1]);
-    listenfd = Open_listenfd(port);
-    clientlen = sizeof(clientaddr);
+    port = atoi(argv[optind]);
+    if (peers != NULL && peer_init(peers, port) < 0) {
+        usage(argv[0]);
+    }
 
-    while (1) {
-        connfd = malloc(sizeof(int));
-        *connfd = Accept(listenfd, (SA *)&clientaddr, (socklen_t *)&clientlen);
-        /* create and start a new thread */
-        Pthread_create(&pid, NULL, doit, (void*)connfd);
+    if (ninherited > 0) {
+        /* the sockets of the image this one replaces, whatever -a says */
+        nlisten = ninherited;
+        acceptors = malloc(nlisten * sizeof(acceptor_t));
+        for (i = 0; i < nlisten; i++) {
+            acceptors[i].listenfd = inherited[i];
+            acceptors[i].cpu = pin ? i % sysconf(_SC_NPROCESSORS_ONLN) : -1;
+            tuneListener(acceptors[i].listenfd);
+        }
+        free(inherited);
+    }
+    else if (nacceptors == 0) {
+        /* one listening socket accepted on by the main thread */
+        nlisten = 1;
+        acceptors = malloc(sizeof(acceptor_t));
+        acceptors->listenfd = Open_listenfd(port);
+        acceptors->cpu = -1;
+        tuneListener(acceptors->listenfd);
+    }
+    else {
+        /*
+         * one SO_REUSEPORT listener per accept thread, the kernel spreads
+         * connections across them so no accept lock is shared; all are
+         * opened before any thread starts accepting
+         */
+        nlisten = nacceptors;
+        acceptors = malloc(nacceptors * sizeof(acceptor_t));
+        for (i = 0; i < nacceptors; i++) {
+            acceptors[i].listenfd = Open_listenfd_reuseport(port);
+            acceptors[i].cpu = pin ? i % sysconf(_SC_NPROCESSORS_ONLN) : -1;
+            tuneListener(acceptors[i].listenfd);
+        }
     }
 
-    return 0;
+    /* connections queue on the sockets from here on, the old image can go */
+    announceReady();
+
+    /* every worker process accepts on the sockets opened above */
+    if (nprocs) {
+        preforkWorkers(nprocs);
+    }
+    if ((drain_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+        unix_error("eventfd error");
+    }
+    accepting = nlisten;
+
+    /* the threads of a process: CONNECT relay, signals, worker pools */
+    tunnel_init(idle_timeout);
+    Pthread_create(&pid, NULL, signalThread, NULL);
+    if (prefetch_workers) {
+        prefetch_init(prefetch_workers, prefetch_budget, prefetchFetch);
+    }
+
+    /* coroutines never hold a thread while waiting for a server */
+    if (hit_workers && engine == ENGINE_CORO) {
+        fprintf(stderr, "-w has no effect with -e coro\n");
+    }
+    else if (hit_workers) {
+        lanesInit(hit_workers, miss_workers);
+    }
+
+    for (i = 1; i < nlisten; i++) {
+        Pthread_create(&pid, NULL, acceptLoop, &acceptors[i]);
+    }
+    acceptLoop(&acceptors[0]);
+
+    /* the process lives on until signalThread() has drained it */
+    pthread_exit(NULL);
 }
 
 /*
- * handle HTTP request/response transaction of a thread
- * clinet-----(request)----->server
- *       <------(data)-------
+ * accept connections on one listening socket and start a thread for
+ * each, until the proxy drains; with a CPU set, the loop and its
+ * threads stay on that CPU
  */
-void *doit(void *connfd) {
-    int fd = *(int *)connfd;
-    int fd_server;
-    /* detach thread */
-    Pthread_detach(pthread_self());
-
-    rio_t rio;
-    char buf[MAXLINE], object_buf[MAX_OBJECT_SIZE];
-    char method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+void *acceptLoop(void *vargp) {
+    acceptor_t *acceptor = (acceptor_t *)vargp;
+    int epfd, n;
+    conn_t *batch[ACCEPT_BATCH];
+    struct epoll_event ev;
+    pthread_attr_t attr;
 
-    /* uri info */
-    char host[MAXLINE];
-    int port;
-    char filename[MAXLINE];
+    pthread_attr_init(&attr);
+    if (acceptor->cpu >= 0) {
+        cpu_set_t cpus;
 
-    /* Read request line and headers */
-    Rio_readinitb(&rio, fd);
-    Rio_readlineb(&rio, buf, MAXLINE);
-    sscanf(buf, "%s %s %s", method, uri, version);
+        CPU_ZERO(&cpus);
+        CPU_SET(acceptor->cpu, &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
 
-    /* request method is not GET */
-    if (strcmp(method, "GET")) {
-        printerror(fd, method, "501", "Not Implemented",
-            "tianqiw's proxy does not implement this method");
-        Close(fd);
-        return NULL;
+    /* the io_uring loop only returns if the kernel lacks io_uring */
+    if (engine == ENGINE_URING &&
+        uring_serve(acceptor->listenfd, hdr_timeout, idle_timeout, &attr) < 0) {
+        fprintf(stderr, "io_uring unavailable, using threads\n");
+    }
+    if (engine == ENGINE_CORO &&
+        coro_serve(acceptor->listenfd, idle_timeout, serveConn) < 0) {
+        fprintf(stderr, "coroutines unavailable, using threads\n");
     }
 
-    /* request method is GET
-     * look for the object in cache */
-    cache_block *block = cache_match(cache_ptr, uri);
+    /* take connections in batches as they come, see acceptBatch() */
+    fcntl(acceptor->listenfd, F_SETFL,
+        fcntl(acceptor->listenfd, F_GETFL) | O_NONBLOCK);
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL;
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+        epoll_ctl(epfd, EPOLL_CTL_ADD, acceptor->listenfd, &ev) < 0) {
+        unix_error("acceptLoop error");
+    }
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &drain_fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, drain_fd, &ev);
 
-    if (block != NULL) {
-        /* cache hit */
-        Rio_writen(fd, block->object, block->object_size);
+    if (lanes) {
+        laneLoop(acceptor->listenfd, epfd, &attr);
     }
     else {
-        /* cache miss */
-        parse_uri(uri, host, &port, filename);
+        while (!__atomic_load_n(&draining, __ATOMIC_ACQUIRE)) {
+            n = acceptBatch(acceptor->listenfd, epfd, batch, 1);
+            dispatchBatch(batch, n, &attr);
+        }
+        unlisten(acceptor->listenfd);
+    }
+
+    Close(epfd);
+    return NULL;
+}
 
-        /* construct the request header */
-        char request_buf[MAXLINE];
-        requestHdr(&rio, request_buf, host, filename);
+/*
+ * accept loop of -w: the events on epfd are new connections on
+ * listenfd (data.ptr NULL), the proxy draining (&drain_fd) and request
+ * headers arriving on a pending_t; once complete, the GETs read in one
+ * round go to the hit lane together
+ * when the proxy drains, the loop unlisten()s and returns once the
+ * headers it is reading are done
+ */
+static void laneLoop(int listenfd, int epfd, pthread_attr_t *attr) {
+    struct epoll_event events[ACCEPT_BATCH];
+    conn_t *accepted[ACCEPT_BATCH], *batch[ACCEPT_BATCH];
+    long last_sweep = rio_clock(), now;
+    pending_t head, *p, *next;
+    int i, k, n, nready, rc;
+
+    head.prev = head.next = &head;
+    while (listenfd >= 0 || head.next != &head) {
+        n = epoll_wait(epfd, events, ACCEPT_BATCH,
+            (head.next != &head) ? LANE_SWEEP : -1);
+        nready = 0;
+
+        for (i = 0; i < n; i++) {
+            p = events[i].data.ptr;
+            if (p == NULL && listenfd >= 0) {
+                k = acceptBatch(listenfd, -1, accepted, ACCEPT_BATCH);
+                while (k > 0) {
+                    pendingAdd(&head, epfd, accepted[--k]);
+                }
+            }
+            else if (p != NULL && (void *)p != &drain_fd) {
+                if ((rc = pendingRead(p)) != 0) {
+                    conn_t *conn = p->conn;
+
+                    pendingDone(p, epfd);
+                    if (rc < 0) {
+                        releaseConn(conn);
+                    }
+                    else if (laneTakes(conn)) {
+                        batch[nready++] = conn;
+                    }
+                    else {
+                        startThread(conn, attr);
+                    }
+                }
+            }
+        }
+        dispatchBatch(batch, nready, attr);
 
-        /* send request to server */
-        if ((fd_server = open_clientfd_r(host, port)) < 0) {
-            /* server connection error */
-            char longmsg[MAXBUF];
-            sprintf(longmsg, "Cannot open connection to server at <%s, %d>", host, port);
-            printerror(fd, "Connection Failed", "404", "Not Found", longmsg);
-            Close(fd);
-            return NULL;
+        if (listenfd >= 0 && __atomic_load_n(&draining, __ATOMIC_ACQUIRE)) {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, listenfd, NULL);
+            unlisten(listenfd);
+            listenfd = -1;
         }
 
-        /* reset rio for server use */
-        memset(&rio, 0, sizeof(rio_t));
-        Rio_readinitb(&rio, fd_server);
-        Rio_writen(fd_server, request_buf, strlen(request_buf));
+        /* drop the clients whose headers did not come in time */
+        if ((now = rio_clock()) - last_sweep >= LANE_SWEEP) {
+            for (p = head.next; p != &head; p = next) {
+                next = p->next;
+                if (p->deadline && now >= p->deadline) {
+                    conn_t *conn = p->conn;
+
+                    pendingDone(p, epfd);
+                    releaseConn(conn);
+                }
+            }
+            last_sweep = now;
+        }
+    }
+}
+
+/* start reading the request headers of a new connection in epfd */
+static void pendingAdd(pending_t *head, int epfd, conn_t *conn) {
+    struct epoll_event ev;
+    pending_t *p;
+    long now = rio_clock();
+
+    if ((p = malloc(sizeof(pending_t))) == NULL ||
+        (conn->pre = buf_get(RIO_BUFSIZE)) == NULL) {
+        free(p);
+        releaseConn(conn);
+        return;
+    }
+    p->conn = conn;
+    p->deadline = hdr_timeout ? now + hdr_timeout : 0;
+    rio_readinitb(&p->rio, conn->fd);
+    fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK);
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = p;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, conn->fd, &ev) < 0) {
+        free(p);
+        releaseConn(conn);
+        return;
+    }
+    p->next = head->next;
+    p->prev = head;
+    head->next->prev = p;
+    head->next = p;
+}
 
-        /* get data from server and send to client */
-        size_t object_size = 0;
-        size_t buflen;
-        int is_exceed = 0;
+/*
+ * read what arrived of the request headers of p into conn->pre, along
+ * with any bytes the client sent after them
+ * return 1 once they are complete, 0 if more are to come, -1 if the
+ * client went away or the headers do not fit RIO_BUFSIZE bytes, which
+ * is answered here
+ */
+static int pendingRead(pending_t *p) {
+    conn_t *conn = p->conn;
+    char *line, *rest;
+    size_t restlen;
+    ssize_t n;
 
-        while ((buflen = Rio_readlineb(&rio, buf, MAXLINE))) {
-            Rio_writen(fd, buf, buflen);
+    /* a piece of a line filling conn->pre ends the loop */
+    while (RIO_BUFSIZE - conn->prelen > 1) {
+        line = conn->pre + conn->prelen;
+        n = rio_tryreadlineb(&p->rio, line, RIO_BUFSIZE - conn->prelen);
+        if (n == RIO_AGAIN) {
+            return 0;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        conn->prelen += n;
 
-            /* size of the buffer exceeds the max object size
-             * discard the buffer */
-            if ((object_size + buflen) > MAX_OBJECT_SIZE) {
-                is_exceed = 1;
+        if (!strcmp(line, "\r\n")) {
+            rest = rio_pending(&p->rio, &restlen);
+            if (conn->prelen + restlen > RIO_BUFSIZE) {
+                break;
             }
-            else {
-                memcpy(object_buf + object_size, buf, buflen);
-                object_size += buflen;
+            if (rest != NULL) {
+                memcpy(conn->pre + conn->prelen, rest, restlen);
+                conn->prelen += restlen;
+            }
+            return 1;
+        }
+    }
+
+    printerror(conn->fd, conn->client, "431", "Request Header Fields Too Large",
+        "The request headers are too large to queue");
+    return -1;
+}
+
+/* the accept loop is done with p: let go of it, conn stays */
+static void pendingDone(pending_t *p, int epfd) {
+    int fd = p->conn->fd;
+
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    rio_freeb(&p->rio);
+    p->prev->next = p->next;
+    p->next->prev = p->prev;
+    free(p);
+}
+
+/*
+ * wait until listenfd has connections and accept every pending one, up
+ * to ACCEPT_BATCH; return the admitted ones in batch and their count
+ * epfd watches listenfd with EPOLLEXCLUSIVE, so a new connection wakes
+ * one of the accept loops sharing listenfd rather than all of them;
+ * with epfd -1, return at once if nothing is pending
+ */
+static int acceptBatch(int listenfd, int epfd, conn_t **batch, int max) {
+    struct sockaddr_in clientaddr;
+    socklen_t clientlen;
+    struct epoll_event ev;
+    int fd, n = 0;
+
+    while (n < max) {
+        clientlen = sizeof(clientaddr);
+        fd = accept4(listenfd, (SA *)&clientaddr, &clientlen, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EAGAIN && n == 0 && epfd >= 0) {
+                /* nothing pending, sleep until a connection arrives */
+                epoll_wait(epfd, &ev, 1, -1);
+                if (__atomic_load_n(&draining, __ATOMIC_ACQUIRE)) {
+                    break;
+                }
+                continue;
             }
+            /* the backlog is drained, or e.g. out of descriptors */
+            break;
         }
+        if ((batch[n] = conn_alloc(fd)) == NULL) {
+            close(fd);
+            continue;
+        }
+        inet_ntop(AF_INET, &clientaddr.sin_addr, batch[n]->client,
+            INET_ADDRSTRLEN);
 
-        /* if not exceed the max object size, insert to cache */
-        if (!is_exceed) {
-            cache_insert(cache_ptr, uri, object_buf, object_size);
+        /* turn a noisy client away before spending a thread on it */
+        if (admit(fd, batch[n]->client) < 0) {
+            conn_free(batch[n]);
+            continue;
         }
+        n++;
+    }
+    return n;
+}
 
-        /* clear the buffer */
-        Close(fd_server);
+/*
+ * dispatch() n connections; with -w they are queued on the hit lane
+ * back to back, and those that do not fit are turned away
+ */
+static void dispatchBatch(conn_t **batch, int n, pthread_attr_t *attr) {
+    int i = 0;
+
+    if (lanes) {
+        i = sbuf_tryinsertn(&hit_lane, (void **)batch, n);
+    }
+    for (; i < n; i++) {
+        dispatch(batch[i], attr);
+    }
+}
+
+/*
+ * set the options every accepted socket inherits from listenfd once on
+ * listenfd; responses go out in a few writes each, which Nagle would
+ * hold back until the client's delayed ACK
+ */
+static void tuneListener(int listenfd) {
+    int on = 1;
+
+    if (tcp_nodelay) {
+        setsockopt(listenfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+    if (client_sndbuf) {
+        setsockopt(listenfd, SOL_SOCKET, SO_SNDBUF, &client_sndbuf,
+            sizeof(client_sndbuf));
+    }
+}
+
+/* a zeroed connection on fd from the buffer pool */
+conn_t *conn_alloc(int fd) {
+    conn_t *conn = (conn_t *)buf_get(sizeof(conn_t));
+
+    if (conn != NULL) {
+        memset(conn, 0, sizeof(conn_t));
+        conn->fd = fd;
+        __atomic_fetch_add(&live_conns, 1, __ATOMIC_RELAXED);
+    }
+    return conn;
+}
+
+/* give a connection and its request bytes back to the pool */
+void conn_free(conn_t *conn) {
+    buf_put(conn->pre);
+    buf_put((char *)conn);
+    __atomic_fetch_sub(&live_conns, 1, __ATOMIC_RELAXED);
+}
+
+/* close a listening socket a front end stopped accepting on */
+void unlisten(int listenfd) {
+    Close(listenfd);
+    __atomic_fetch_sub(&accepting, 1, __ATOMIC_RELEASE);
+}
+
+/* check a new connection against the client limits */
+int admit(int fd, char *client) {
+    int rc;
+
+    if ((rc = limiter_acquire(client_limit, client)) != LIMIT_OK) {
+        refuse(fd, client, rc);
+        Close(fd);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * create and start a new thread for an admitted connection, or queue
+ * it for the hit workers
+ */
+int dispatch(conn_t *conn, pthread_attr_t *attr) {
+    if (lanes && laneTakes(conn)) {
+        if (sbuf_tryinsert(&hit_lane, conn) < 0) {
+            printerror(conn->fd, conn->client, "503", "Service Unavailable",
+                "Too many connections waiting");
+            releaseConn(conn);
+            return -1;
+        }
+        return 0;
+    }
+
+    return startThread(conn, attr);
+}
+
+/*
+ * with -w, whether conn goes to the hit lane: a GET whose headers are
+ * all in conn->pre, so a hit worker never waits for the client
+ */
+static int laneTakes(conn_t *conn) {
+    return conn->prelen >= 4 && !strncmp(conn->pre, "GET ", 4) &&
+        memmem(conn->pre, conn->prelen, "\r\n\r\n", 4) != NULL;
+}
+
+/* serve conn on a new thread, return -1 if it could not be started */
+static int startThread(conn_t *conn, pthread_attr_t *attr) {
+    pthread_t pid;
+
+    if (pthread_create(&pid, attr, doit, (void *)conn) != 0) {
+        releaseConn(conn);
+        return -1;
     }
+    return 0;
+}
+
+/* thread routine serving one client connection */
+void *doit(void *vargp) {
+    conn_t *conn = (conn_t *)vargp;
 
-    Close(fd);
+    /* detach thread */
+    Pthread_detach(pthread_self());
+
+    serveConn(conn);
     return NULL;
 }
 
+/* serve an admitted connection, let go of it unless a miss worker took it */
+static void serveConn(conn_t *conn) {
+    if (!serve(conn)) {
+        releaseConn(conn);
+    }
+}
+
+/* log the request of a connection, close it and let go of it */
+static void releaseConn(conn_t *conn) {
+    if (conn->rec.time) {
+        conn->rec.latency = accesslog_now() - conn->rec.time;
+        accesslog_write(&conn->rec);
+    }
+    if (conn->fd >= 0) {
+        Close(conn->fd);
+    }
+    limiter_release(client_limit, conn->client);
+    conn_free(conn);
+}
+
+/* start the hit and miss worker pools */
+static void lanesInit(int hit_workers, int miss_workers) {
+    pthread_t pid;
+    int i;
+
+    sbuf_init(&hit_lane, LANE_QUEUE);
+    sbuf_init(&miss_lane, LANE_QUEUE);
+    for (i = 0; i < hit_workers; i++) {
+        Pthread_create(&pid, NULL, hitWorker, NULL);
+    }
+    for (i = 0; i < miss_workers; i++) {
+        Pthread_create(&pid, NULL, missWorker, NULL);
+    }
+    lanes = 1;
+}
+
+/* hit worker: read requests and answer the hits, pass misses on */
+static void *hitWorker(void *vargp) {
+    Pthread_detach(pthread_self());
+
+    while (1) {
+        serveConn(sbuf_remove(&hit_lane));
+    }
+    return NULL;
+}
+
+/* miss worker: fetch queued misses from their servers */
+static void *missWorker(void *vargp) {
+    Pthread_detach(pthread_self());
+
+    while (1) {
+        miss_t *req = sbuf_remove(&miss_lane);
+        fetchMiss(req);
+        releaseConn(req->conn);
+        missFree(req);
+    }
+    return NULL;
+}
+
+/*
+ * handle HTTP request/response transaction of a connection
+ * clinet-----(request)----->server
+ *       <------(data)-------
+ * conn->pre holds the first conn->prelen bytes of the request if they
+ * were read from the connection already
+ * return 1 if the request missed the cache and was queued for a miss
+ * worker, which owns conn from then on; 0 once the request is done
+ */
+static int serve(conn_t *conn) {
+    int fd = conn->fd, is_get, queued = 0, read_ms;
+    long start = rio_clock();
+    long deadline = req_timeout ? start + req_timeout : 0;
+    rio_t rio;
+    char *line = buf_get(MAXLINE);
+    miss_t *req = (miss_t *)buf_get(sizeof(miss_t));
+
+    /* Read request line and headers, a slow client gets hdr_timeout; the
+     * client is only read from for those */
+    read_ms = idle_timeout;
+    if (hdr_timeout && (!read_ms || hdr_timeout < read_ms)) {
+        read_ms = hdr_timeout;
+    }
+    setTimeouts(fd, read_ms);
+    rio_readinitb(&rio, fd);
+
+    /* bytes an event loop read before handing the connection over come
+     * first */
+    if (line == NULL || req == NULL ||
+        rio_unread(&rio, conn->pre, conn->prelen) < 0) {
+        buf_put(line);
+        buf_put((char *)req);
+        return 0;
+    }
+    if (hdr_timeout && (!deadline || start + hdr_timeout < deadline)) {
+        rio_setdeadline(&rio, start + hdr_timeout);
+    }
+    else {
+        rio_setdeadline(&rio, deadline);
+    }
+
+    req->conn = conn;
+    req->deadline = deadline;
+    req->uri = req->host = req->request_buf = NULL;
+    req->range[0] = '\0';
+    is_get = readRequest(conn, &rio, line, req);
+
+    /* the client's buffers are idle while the response is on its way */
+    rio_freeb(&rio);
+    buf_put(line);
+    if (is_get) {
+        queued = serveGet(conn, req);
+    }
+    if (!queued) {
+        missFree(req);
+    }
+    return queued;
+}
+
+/*
+ * read a request from rio into req, line is a MAXLINE buffer for its
+ * lines; anything but a GET is answered here
+ * return 1 if req holds a GET to serve, 0 once the request is done
+ */
+static int readRequest(conn_t *conn, rio_t *rio, char *line, miss_t *req) {
+    int fd = conn->fd;
+    char method[16], version[16];
+    char *filename;
+    size_t len;
+
+    if (rio_readlineb(rio, line, MAXLINE) <= 0) {
+        return 0;
+    }
+    conn->rec.time = accesslog_now();
+    inet_pton(AF_INET, conn->client, &conn->rec.client);
+
+    /* uri and the host in it fit in the length of the line */
+    len = strlen(line) + 1;
+    if ((req->uri = buf_get(len)) == NULL ||
+        (req->host = buf_get(len)) == NULL) {
+        return 0;
+    }
+    if (sscanf(line, "%15s %s %15s", method, req->uri, version) != 3) {
+        conn->rec.status = 400;
+        printerror(fd, line, "400", "Bad Request",
+            "Cannot parse the request line");
+        return 0;
+    }
+
+    conn->rec.uri_hash = fnv1a_hash(req->uri);
+
+    /* CONNECT host:port opens a tunnel relayed by the tunnel thread */
+    if (!strcmp(method, "CONNECT")) {
+        conn->rec.source = LOG_TUNNEL;
+        if (connectTunnel(fd, rio, req->uri, line, &conn->rec) == 0) {
+            conn->fd = -1;
+        }
+        return 0;
+    }
+
+    /* request method is not GET */
+    if (strcmp(method, "GET")) {
+        conn->rec.status = 501;
+        printerror(fd, method, "501", "Not Implemented",
+            "tianqiw's proxy does not implement this method");
+        return 0;
+    }
+
+    /* construct the request header, the client's Range is kept aside */
+    if ((filename = buf_get(len)) == NULL) {
+        return 0;
+    }
+    parse_uri(req->uri, req->host, &req->port, filename);
+    if (requestHdr(rio, req, filename, line) < 0) {
+        buf_put(filename);
+        return 0;
+    }
+    buf_put(filename);
+    return 1;
+}
+
+/*
+ * answer the GET in req from the cache, or fetch it from the server
+ * return 1 if req was queued for a miss worker, 0 once it is done
+ */
+static int serveGet(conn_t *conn, miss_t *req) {
+    int fd = conn->fd;
+    char *decoded;
+    cache_block hit, *block;
+
+    /* request method is GET
+     * look for the object in cache, a hit is pinned in place */
+    if ((block = cache_match(cache_ptr, req->uri, &hit)) != NULL) {
+        /* cache hit, compressed objects are decoded into a pooled buffer */
+        size_t object_size;
+        char *object = hitObject(block, &decoded, &object_size);
+        conn->rec.source = LOG_HIT;
+        if (block->freshness == CACHE_REFRESH) {
+            refresh(req->uri);
+        }
+        if (object != NULL) {
+            serveObject(fd, block, object, object_size, req->range,
+                &conn->rec);
+        }
+        buf_put(decoded);
+        cache_release(block);
+    }
+    else if (strlen(req->range) &&
+        serveChunks(fd, req->uri, req->range, &conn->rec)) {
+        conn->rec.source = LOG_HIT;
+    }
+    else {
+        /* cache miss, go to the server here or on a miss worker */
+        conn->rec.source = LOG_MISS;
+        if (lanes) {
+            return missLane(req);
+        }
+        fetchMiss(req);
+    }
+    return 0;
+}
+
+/* give req and its buffers back to the pool */
+static void missFree(miss_t *req) {
+    buf_put(req->uri);
+    buf_put(req->host);
+    buf_put(req->request_buf);
+    buf_put((char *)req);
+}
+
+/*
+ * return the servable bytes of a cached object as cache_object() does, a
+ * compressed object is decoded into a pooled buffer left in *decoded for
+ * the caller to buf_put(), otherwise *decoded is NULL
+ */
+static char *hitObject(cache_block *block, char **decoded, size_t *size) {
+    *decoded = NULL;
+    if (block->compressed &&
+        (*decoded = buf_get(MAX_OBJECT_SIZE)) == NULL) {
+        return NULL;
+    }
+    return cache_object(block, *decoded, size);
+}
+
+/*
+ * queue a miss for the miss workers, which give req back with missFree()
+ * return 1 if queued, 0 if the queue is full and the client got a 503
+ */
+static int missLane(miss_t *req) {
+    if (sbuf_tryinsert(&miss_lane, req) == 0) {
+        return 1;
+    }
+    req->conn->rec.status = 503;
+    printerror(req->conn->fd, req->uri, "503", "Service Unavailable",
+        "Too many cache misses in flight");
+    return 0;
+}
+
+/* fetch a request that missed the cache from its server */
+static void fetchMiss(miss_t *req) {
+    int fd = req->conn->fd, fd_server, rc;
+    char *uri = req->uri, *host = req->host, *range = req->range;
+    log_record *rec = &req->conn->rec;
+    char buf[MAX_RANGE + 32];
+    long first, last;
+    int n, ranged = 0;
+    peer_t *peer;
+    rio_t rio;
+
+    if (strlen(range)) {
+        if (chunk_mode && http_parse_range(range, -1, &first, &last) == 1) {
+            /* ask for whole chunks so that they can be cached */
+            first -= first % CHUNK_SIZE;
+            if (last >= 0) {
+                last += CHUNK_SIZE - 1 - last % CHUNK_SIZE;
+                n = sprintf(buf, "Range: bytes=%ld-%ld\r\n", first, last);
+            }
+            else {
+                n = sprintf(buf, "Range: bytes=%ld-\r\n", first);
+            }
+            ranged = 1;
+        }
+        else {
+            n = sprintf(buf, "Range: %s\r\n", range);
+        }
+        if (requestAppend(req, buf, n) < 0) {
+            return;
+        }
+    }
+    if (requestAppend(req, "\r\n", 2) < 0) {
+        return;
+    }
+
+    /* a URI another peer owns is for that peer to fetch and cache, unless
+     * it cannot be reached */
+    if (!req->from_peer && (peer = peer_owner(uri)) != NULL &&
+        fetchPeer(req, peer, ranged) == 0) {
+        return;
+    }
+
+    /* keep a single origin from taking every thread */
+    if ((rc = limiter_acquire(host_limit, host)) != LIMIT_OK) {
+        rec->status = (rc == LIMIT_RATE) ? 429 : 503;
+        refuse(fd, host, rc);
+        return;
+    }
+
+    /* send request to server */
+    if ((fd_server = openServer(host, req->port)) < 0) {
+        /* server connection error */
+        rec->status = 404;
+        connectError(fd, host, req->port, "404", "Not Found");
+        limiter_release(host_limit, host);
+        return;
+    }
+
+    /* rio for the server, the rest of the request has to finish before
+     * the deadline */
+    setTimeouts(fd_server, idle_timeout);
+    rio_readinitb(&rio, fd_server);
+    rio_setdeadline(&rio, req->deadline);
+
+    /* get data from server, send to client and cache it */
+    if (rio_writen(fd_server, req->request_buf, req->request_len) >= 0) {
+        relayResponse(fd, &rio, uri, range, ranged, 1, rec);
+    }
+
+    /* clear the buffer */
+    rio_freeb(&rio);
+    Close(fd_server);
+    limiter_release(host_limit, host);
+}
+
+/*
+ * send a miss to the peer owning it, as a proxy request for the whole
+ * uri marked with PEER_HDR, and relay the response without caching it
+ * return -1 if the peer cannot be reached, the client got nothing then
+ */
+static int fetchPeer(miss_t *req, peer_t *peer, int ranged) {
+    char peer_line[] = " HTTP/1.0\r\n" PEER_HDR ": 1\r\n";
+    char *rest = memchr(req->request_buf, '\n', req->request_len) + 1;
+    struct iovec iov[4];
+    int fd_peer;
+    rio_t rio;
+
+    if ((fd_peer = openServer(peer->host, peer->port)) < 0) {
+        peer_failed(peer);
+        return -1;
+    }
+
+    /* the request line names the whole uri, the headers follow as they
+     * would go to the origin */
+    iov[0].iov_base = "GET ";
+    iov[0].iov_len = 4;
+    iov[1].iov_base = req->uri;
+    iov[1].iov_len = strlen(req->uri);
+    iov[2].iov_base = peer_line;
+    iov[2].iov_len = strlen(peer_line);
+    iov[3].iov_base = rest;
+    iov[3].iov_len = req->request_buf + req->request_len - rest;
+    if (rio_writevn(fd_peer, iov, 4) < 0) {
+        peer_failed(peer);
+        Close(fd_peer);
+        return -1;
+    }
+
+    setTimeouts(fd_peer, idle_timeout);
+    rio_readinitb(&rio, fd_peer);
+    rio_setdeadline(&rio, req->deadline);
+    req->conn->rec.source = LOG_PEER;
+    relayResponse(req->conn->fd, &rio, req->uri, req->range, ranged, 0,
+        &req->conn->rec);
+
+    rio_freeb(&rio);
+    Close(fd_peer);
+    return 0;
+}
+
+/*
+ * tell the client the server at host:port cannot be reached; kept out of
+ * the callers so their frames stay small while they wait on the server
+ */
+static void connectError(int fd, char *host, int port, char *errnum,
+    char *shortmsg) {
+
+    char longmsg[MAXBUF];
+
+    snprintf(longmsg, MAXBUF, "Cannot open connection to server at <%s, %d>",
+        host, port);
+    printerror(fd, "Connection Failed", errnum, shortmsg, longmsg);
+}
+
+/*
+ * bound every read on fd by read_ms and every write by idle_timeout;
+ * the deadlines of rio are only checked as reads return, so these
+ * timeouts are what keeps a blocking read from outliving them
+ */
+static void setTimeouts(int fd, int read_ms) {
+    struct timeval tv;
+
+    if (read_ms) {
+        tv.tv_sec = read_ms / 1000;
+        tv.tv_usec = (read_ms % 1000) * 1000;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+    if (idle_timeout) {
+        tv.tv_sec = idle_timeout / 1000;
+        tv.tv_usec = (idle_timeout % 1000) * 1000;
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    }
+}
+
+/*
+ * parse "rcvbuf:sndbuf" socket buffer sizes with k/m suffixes into
+ * upstream_rcvbuf and client_sndbuf, return -1 if spec is malformed
+ */
+static int parseBufs(char *spec) {
+    char *sep = strchr(spec, ':');
+    long rcvbuf, sndbuf;
+
+    if (sep == NULL) {
+        return -1;
+    }
+    *sep = '\0';
+    rcvbuf = parse_size(spec);
+    sndbuf = parse_size(sep + 1);
+    *sep = ':';
+    if (rcvbuf < 0 || sndbuf < 0 || rcvbuf > (1L << 30) || sndbuf > (1L << 30)) {
+        return -1;
+    }
+    upstream_rcvbuf = rcvbuf;
+    client_sndbuf = sndbuf;
+    return 0;
+}
+
+/* connect to a server with the socket tuning of -b and -n */
+static int openServer(char *host, int port) {
+    int fd = open_clientfd_buf(host, port, conn_timeout, upstream_rcvbuf, 0);
+    int on = 1;
+
+    if (fd >= 0 && tcp_nodelay) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+    return fd;
+}
+
+/* cork or uncork a client socket if -n asks for it, uncorking flushes */
+static void setCork(int fd, int on) {
+    if (tcp_cork && fd >= 0) {
+        setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+    }
+}
+
+/*
+ * parse "header:connect:idle:total" timeouts in seconds
+ * trailing fields may be left out, return -1 if spec is malformed
+ */
+static int parseTimeouts(char *spec) {
+    int *timeouts[] = {&hdr_timeout, &conn_timeout, &idle_timeout, &req_timeout};
+    char *p = spec, *end;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        double secs = strtod(p, &end);
+        if (end == p || secs < 0) {
+            return -1;
+        }
+        *timeouts[i] = secs * 1000;
+        if (*end == '\0') {
+            return 0;
+        }
+        if (*end != ':') {
+            return -1;
+        }
+        p = end + 1;
+    }
+    return -1;
+}
+
+/*
+ * fork nprocs worker processes, which return from here and serve the
+ * listening sockets with their own threads; the master stays in here
+ * waiting for signals: it replaces workers that exit, passes SIGTERM on
+ * to the workers and exits once they are gone, and on SIGHUP does the
+ * same after a new image took over its sockets and cache, see reload()
+ */
+static void preforkWorkers(int nprocs) {
+    pid_t *workers, pid;
+    sigset_t sigs;
+    int i, sig, status, left, stopping = 0;
+
+    /* SIGCHLD is waited for along with the signals blocked in main() */
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGHUP);
+
+    if ((workers = calloc(nprocs, sizeof(pid_t))) == NULL) {
+        unix_error("preforkWorkers error");
+    }
+    for (i = 0; i < nprocs; i++) {
+        if ((workers[i] = forkWorker()) == 0) {
+            return;
+        }
+    }
+
+    while (1) {
+        if (sigwait(&sigs, &sig) != 0 ||
+            (sig == SIGHUP && (stopping || reload() < 0))) {
+            continue;
+        }
+        if (sig != SIGCHLD && !stopping) {
+            /* the workers drain, and are not replaced any more */
+            stopping = 1;
+            for (i = 0; i < nprocs; i++) {
+                if (workers[i] > 0) {
+                    kill(workers[i], SIGTERM);
+                }
+            }
+        }
+
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (i = 0; i < nprocs && workers[i] != pid; i++)
+                ;
+            if (i == nprocs) {
+                /* a new image that failed, reload() is done with it */
+                continue;
+            }
+            if (stopping) {
+                workers[i] = 0;
+                continue;
+            }
+            if (WIFSIGNALED(status)) {
+                fprintf(stderr, "worker %d killed by signal %d, restarting\n",
+                    pid, WTERMSIG(status));
+            }
+            else {
+                fprintf(stderr, "worker %d exited with status %d, restarting\n",
+                    pid, WEXITSTATUS(status));
+            }
+
+            /* a worker that keeps dying does not spin the master */
+            usleep(100 * 1000);
+            if ((workers[i] = forkWorker()) == 0) {
+                return;
+            }
+        }
+
+        for (i = left = 0; i < nprocs; i++) {
+            left += workers[i] != 0;
+        }
+        if (stopping && left == 0) {
+            exit(0);
+        }
+    }
+}
+
+/* fork a worker process, return 0 in the worker and its pid in the master */
+static pid_t forkWorker(void) {
+    sigset_t chld;
+    pid_t pid;
+
+    if ((pid = Fork()) == 0) {
+        /* workers go with the master, which keeps SIGHUP to itself */
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        is_worker = 1;
+        sigemptyset(&chld);
+        sigaddset(&chld, SIGCHLD);
+        pthread_sigmask(SIG_UNBLOCK, &chld, NULL);
+    }
+    return pid;
+}
+
+/*
+ * thread routine taking the signals every thread blocks: SIGUSR2 prints
+ * the cache statistics, SIGTERM drains the process, SIGHUP starts a new
+ * image on the listening sockets and then drains this one; a worker
+ * process of -P leaves SIGHUP to its master
+ */
+static void *signalThread(void *vargp) {
+    sigset_t sigs;
+    int sig;
+
+    Pthread_detach(pthread_self());
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGUSR2);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGHUP);
+
+    while (sigwait(&sigs, &sig) == 0) {
+        if (sig == SIGUSR2) {
+            cache_stats(cache_ptr, stderr);
+        }
+        else if (sig == SIGTERM || (!is_worker && reload() == 0)) {
+            drain();
+        }
+    }
+    return NULL;
+}
+
+/*
+ * stop accepting, wait up to drain_ms for the connections accepted so
+ * far to be done, write out the access log and exit; what is still open
+ * then, and CONNECT tunnels and background fetches, which are not
+ * waited for, is cut
+ */
+static void drain(void) {
+    long deadline = rio_clock() + drain_ms, left;
+    uint64_t one = 1;
+
+    __atomic_store_n(&draining, 1, __ATOMIC_RELEASE);
+    if (write(drain_fd, &one, sizeof(one)) < 0) {
+        unix_error("drain error");
+    }
+
+    while ((__atomic_load_n(&accepting, __ATOMIC_ACQUIRE) > 0 ||
+        __atomic_load_n(&live_conns, __ATOMIC_RELAXED) > 0) &&
+        (drain_ms == 0 || rio_clock() < deadline)) {
+        usleep(DRAIN_POLL * 1000);
+    }
+    if ((left = __atomic_load_n(&live_conns, __ATOMIC_RELAXED)) > 0) {
+        fprintf(stderr, "drain: %ld connections cut at the deadline\n", left);
+    }
+    accesslog_flush();
+    exit(0);
+}
+
+/*
+ * start a new image of the proxy, self_path with the arguments of this
+ * one, on the listening sockets of this one and, with -P, its shared
+ * cache; the descriptors are handed down in the ENV_* variables
+ * return 0 once the new image announced it is ready, -1 if it could not
+ * be started or did not come up within RELOAD_WAIT ms, and this image
+ * carries on as before
+ */
+static int reload(void) {
+    char **envp, *listen_env, cache_env[64], ready_env[64];
+    int ready[2], i, n, len, ok;
+    struct pollfd pfd;
+    pid_t pid;
+    char c;
+
+    /* the environment of the new image is made before forking */
+    for (n = 0; environ[n] != NULL; n++)
+        ;
+    envp = malloc((n + 4) * sizeof(char *));
+    listen_env = malloc(sizeof(ENV_LISTEN) + 12 * nlisten);
+    if (envp == NULL || listen_env == NULL || pipe2(ready, O_CLOEXEC) < 0) {
+        free(envp);
+        free(listen_env);
+        return -1;
+    }
+    memcpy(envp, environ, n * sizeof(char *));
+    len = sprintf(listen_env, "%s=", ENV_LISTEN);
+    for (i = 0; i < nlisten; i++) {
+        len += sprintf(listen_env + len, "%s%d", i ? "," : "",
+            acceptors[i].listenfd);
+    }
+    envp[n++] = listen_env;
+    sprintf(ready_env, "%s=%d", ENV_READY, ready[1]);
+    envp[n++] = ready_env;
+    if (cache_ptr->shm_fd >= 0) {
+        sprintf(cache_env, "%s=%d", ENV_CACHE, cache_ptr->shm_fd);
+        envp[n++] = cache_env;
+    }
+    envp[n] = NULL;
+
+    if ((pid = fork()) == 0) {
+        /* nothing but what is handed down survives the exec() */
+        close_range(3, ~0U, CLOSE_RANGE_CLOEXEC);
+        for (i = 0; i < nlisten; i++) {
+            fcntl(acceptors[i].listenfd, F_SETFD, 0);
+        }
+        if (cache_ptr->shm_fd >= 0) {
+            fcntl(cache_ptr->shm_fd, F_SETFD, 0);
+        }
+        fcntl(ready[1], F_SETFD, 0);
+        execve(self_path, self_argv, envp);
+        _exit(127);
+    }
+    close(ready[1]);
+    free(envp);
+    free(listen_env);
+
+    /* the pipe reads EOF if the new image exits before it is ready */
+    pfd.fd = ready[0];
+    pfd.events = POLLIN;
+    ok = pid > 0 && poll(&pfd, 1, RELOAD_WAIT) > 0 && read(ready[0], &c, 1) == 1;
+    close(ready[0]);
+    if (!ok) {
+        fprintf(stderr, "reload: the new image did not come up, carrying on\n");
+        if (pid > 0) {
+            kill(pid, SIGKILL);
+            waitpid(pid, NULL, 0);
+        }
+        return -1;
+    }
+    fprintf(stderr, "reload: process %d took over, draining\n", pid);
+    return 0;
+}
+
+/*
+ * take what the image this one replaces handed down, see reload(): its
+ * listening sockets into *fds, malloc()ed, and the segment of its shared
+ * cache into *cache_fd, -1 if none; the variables are gone afterwards
+ * return the number of sockets, 0 if this image was started afresh
+ */
+static int inherit(int **fds, int *cache_fd) {
+    char *env, *end;
+    int n = 0;
+
+    *cache_fd = -1;
+    if ((env = getenv(ENV_READY)) != NULL) {
+        ready_fd = atoi(env);
+        fcntl(ready_fd, F_SETFD, FD_CLOEXEC);
+    }
+    if ((env = getenv(ENV_CACHE)) != NULL) {
+        *cache_fd = atoi(env);
+    }
+    if ((env = getenv(ENV_LISTEN)) != NULL &&
+        (*fds = malloc((strlen(env) / 2 + 1) * sizeof(int))) != NULL) {
+        while (*env != '\0') {
+            (*fds)[n] = strtol(env, &end, 10);
+            if (end == env) {
+                break;
+            }
+            fcntl((*fds)[n++], F_SETFD, FD_CLOEXEC);
+            env = (*end == ',') ? end + 1 : end;
+        }
+    }
+    unsetenv(ENV_LISTEN);
+    unsetenv(ENV_CACHE);
+    unsetenv(ENV_READY);
+    return n;
+}
+
+/* tell the image this one replaces that it may drain now */
+static void announceReady(void) {
+    if (ready_fd >= 0) {
+        if (write(ready_fd, "", 1) < 0) {
+            fprintf(stderr, "reload: the old image is gone\n");
+        }
+        close(ready_fd);
+        ready_fd = -1;
+    }
+}
+
+/* answer a request turned away by a limiter */
+static void refuse(int fd, char *cause, int reason) {
+    if (reason == LIMIT_RATE) {
+        printerror(fd, cause, "429", "Too Many Requests",
+            "Request rate limit exceeded");
+    }
+    else {
+        printerror(fd, cause, "503", "Service Unavailable",
+            "Too many requests in flight");
+    }
+}
+
+/*
+ * answer a CONNECT request and hand the connection to the tunnel relay
+ * the request headers are skipped through line (MAXLINE bytes)
+ * return 0 if the relay owns fd now and logs rec when the tunnel closes,
+ * rec->time is cleared then; -1 if the tunnel failed and the caller
+ * still has to close fd
+ */
+static int connectTunnel(int fd, rio_t *rio, char *uri, char *line,
+    log_record *rec) {
+
+    char *host, *early;
+    size_t early_len;
+    int port, fd_server;
+    ssize_t rc;
+    char *established = "HTTP/1.1 200 Connection established\r\n\r\n";
+
+    /* skip the request headers */
+    while ((rc = rio_readlineb(rio, line, MAXLINE)) > 0) {
+        if (!strcmp(line, "\r\n")) {
+            break;
+        }
+    }
+    if (rc <= 0 || (host = buf_get(strlen(uri) + 1)) == NULL) {
+        return -1;
+    }
+
+    if (sscanf(uri, "%[^:]:%d", host, &port) != 2) {
+        rec->status = 400;
+        printerror(fd, uri, "400", "Bad Request",
+            "CONNECT needs a host:port target");
+        buf_put(host);
+        return -1;
+    }
+
+    if ((fd_server = openServer(host, port)) < 0) {
+        rec->status = 502;
+        connectError(fd, host, port, "502", "Bad Gateway");
+        buf_put(host);
+        return -1;
+    }
+    buf_put(host);
+
+    /* bytes the client sent right after its headers belong to the server */
+    rec->status = 200;
+    early = rio_pending(rio, &early_len);
+    if (rio_writen(fd, established, strlen(established)) < 0 ||
+        (early_len > 0 && rio_writen(fd_server, early, early_len) < 0)) {
+        Close(fd_server);
+        return -1;
+    }
+
+    /* the relay logs the request once the tunnel closes */
+    rec->bytes = strlen(established);
+    if (tunnel_add(fd, fd_server, rec) < 0) {
+        Close(fd_server);
+        return -1;
+    }
+    rec->time = 0;
+    return 0;
+}
+
+/* cache key of chunk n of uri, n < 0 for the response header block */
+static void chunkKey(char *key, char *uri, long n) {
+    if (n < 0) {
+        sprintf(key, "%s#h", uri);
+    }
+    else {
+        sprintf(key, "%s#%ld", uri, n);
+    }
+}
+
+/*
+ * format the header of a 206 response carrying bytes [first, last] into
+ * buf (MAXLINE), return its length
+ */
+static int rangeHdr(char *buf, char *hdrs, size_t hdr_len,
+    long first, long last, long total) {
+
+    char type[MAXLINE / 2];
+    int n = sprintf(buf, "HTTP/1.0 206 Partial Content\r\n");
+
+    if (http_get_header(hdrs, hdr_len, "Content-Type", type, MAXLINE / 2)) {
+        n += sprintf(buf + n, "Content-Type: %s\r\n", type);
+    }
+    n += sprintf(buf + n, "Content-Range: bytes %ld-%ld/%ld\r\n"
+        "Content-Length: %ld\r\n\r\n", first, last, total, last - first + 1);
+    return n;
+}
+
+/* send a 416 response for an entity of total bytes */
+static void rangeError(int fd, long total) {
+    char buf[MAXLINE];
+    int n = sprintf(buf, "HTTP/1.0 416 Range Not Satisfiable\r\n"
+        "Content-Range: bytes */%ld\r\nContent-Length: 0\r\n\r\n", total);
+    rio_writen(fd, buf, n);
+}
+
+/*
+ * serve the size bytes of the cached response of block to the client,
+ * in a single write
+ * a Range request on a complete 200 response is answered with a 206
+ * carrying just the requested bytes, anything else is sent with the
+ * header prepared by cache_insert_response() and its Age filled in
+ */
+static void serveObject(int fd, cache_block *block, char *object,
+    size_t size, char *range, log_record *rec) {
+
+    size_t hdr_len = block->hdr_len;
+    long first, last, total;
+    char buf[MAXLINE], age[HTTP_AGE_WIDTH];
+    struct iovec iov[3];
+    ssize_t rc;
+    int n;
+
+    if (hdr_len == 0) {
+        hdr_len = http_header_len(object, size);
+    }
+
+    if (strlen(range) && hdr_len && http_status(object, hdr_len) == 200) {
+        total = size - hdr_len;
+        switch (http_parse_range(range, total, &first, &last)) {
+        case 1:
+            rec->status = 206;
+            iov[0].iov_base = buf;
+            iov[0].iov_len = rangeHdr(buf, object, hdr_len, first, last, total);
+            iov[1].iov_base = object + hdr_len + first;
+            iov[1].iov_len = last - first + 1;
+            if ((rc = rio_writevn(fd, iov, 2)) >= 0) {
+                rec->bytes = rc;
+            }
+            return;
+        case -1:
+            rec->status = 416;
+            rangeError(fd, total);
+            return;
+        }
+    }
+    rec->status = http_status(object, size);
+    n = cache_response(block, object, size, iov, age);
+    if ((rc = rio_writevn(fd, iov, n)) >= 0) {
+        rec->bytes = rc;
+    }
+}
+
+/*
+ * answer a Range request from cached chunks of a large object
+ * return 1 if served, 0 if the header block or any chunk is missing
+ */
+static int serveChunks(int fd, char *uri, char *range, log_record *rec) {
+    char key[CHUNK_KEYLEN], buf[MAXLINE];
+    cache_block hit, *block, chunks[MAX_RANGE_CHUNKS];
+    struct iovec iov[MAX_RANGE_CHUNKS + 1];
+    char *hdrs, *decoded;
+    size_t hdr_len;
+    long start, total, first, last, i, n = 0, found = 0;
+    int served = 0;
+    ssize_t rc;
+
+    chunkKey(key, uri, -1);
+    if ((block = cache_match(cache_ptr, key, &hit)) == NULL) {
+        return 0;
+    }
+    if ((hdrs = hitObject(block, &decoded, &hdr_len)) == NULL ||
+        (total = http_entity_length(hdrs, hdr_len, &start)) < 0) {
+        buf_put(decoded);
+        cache_release(block);
+        return 0;
+    }
+
+    switch (http_parse_range(range, total, &first, &last)) {
+    case 0:
+        buf_put(decoded);
+        cache_release(block);
+        return 0;
+    case -1:
+        rec->status = 416;
+        rangeError(fd, total);
+        buf_put(decoded);
+        cache_release(block);
+        return 1;
+    }
+
+    /* every chunk covering the range has to be cached */
+    n = last / CHUNK_SIZE - first / CHUNK_SIZE + 1;
+    if (n <= MAX_RANGE_CHUNKS) {
+        for (found = 0; found < n; found++) {
+            long off = (first / CHUNK_SIZE + found) * CHUNK_SIZE;
+            size_t expect = (total - off < CHUNK_SIZE) ? total - off : CHUNK_SIZE;
+
+            chunkKey(key, uri, off / CHUNK_SIZE);
+            if (cache_match(cache_ptr, key, &chunks[found]) == NULL) {
+                break;
+            }
+            if (chunks[found].object_size != expect) {
+                cache_release(&chunks[found]);
+                break;
+            }
+        }
+    }
+
+    /* chunks hold body bytes only and are never stored compressed, the
+     * header and the pieces of every chunk go out in one write */
+    if (found == n) {
+        rec->status = 206;
+        iov[0].iov_base = buf;
+        iov[0].iov_len = rangeHdr(buf, hdrs, hdr_len, first, last, total);
+        for (i = 0; i < n; i++) {
+            long off = (first / CHUNK_SIZE + i) * CHUNK_SIZE;
+            long from = (first > off) ? first - off : 0;
+            long to = (last < off + CHUNK_SIZE - 1) ? last - off : CHUNK_SIZE - 1;
+            iov[i + 1].iov_base = chunks[i].object + from;
+            iov[i + 1].iov_len = to - from + 1;
+        }
+        if ((rc = rio_writevn(fd, iov, n + 1)) >= 0) {
+            rec->bytes = rc;
+        }
+        served = 1;
+    }
+
+    for (i = 0; i < found; i++) {
+        cache_release(&chunks[i]);
+    }
+    buf_put(decoded);
+    cache_release(block);
+    return served;
+}
+
+/*
+ * relay the server's response to the client and cache it if keep is set
+ * whole responses that fit are cached under uri; with chunk_mode the
+ * body of larger 200/206 responses is cached in CHUNK_SIZE pieces
+ * if ranged is set, the server was asked for a chunk aligned superset
+ * of the client's range and only the client's bytes are sent back
+ */
+static void relayResponse(int fd, rio_t *rio, char *uri, char *range,
+    int ranged, int keep, log_record *rec) {
+
+    relay_t relay;
+
+    relay.object = relay.chunk = relay.key = NULL;
+    relay.object_size = relay.chunk_len = 0;
+    relay.keep = keep;
+    if ((relay.buf = buf_get(MAXLINE)) != NULL) {
+        setCork(fd, 1);
+        relayStream(fd, rio, uri, range, ranged, &relay, rec);
+        setCork(fd, 0);
+    }
+    buf_put(relay.buf);
+    buf_put(relay.object);
+    buf_put(relay.chunk);
+    buf_put(relay.key);
+}
+
+/*
+ * append n bytes of data to the object being cached, whose buffer grows
+ * up to MAX_OBJECT_SIZE; return -1 once the object is too large, it is
+ * dropped then
+ */
+static int relayKeep(relay_t *relay, char *data, size_t n) {
+    char *grown = NULL;
+
+    if (relay->object_size + n <= MAX_OBJECT_SIZE) {
+        grown = buf_grow(relay->object, relay->object_size + n);
+    }
+    if (grown == NULL) {
+        buf_put(relay->object);
+        relay->object = NULL;
+        return -1;
+    }
+    relay->object = grown;
+    memcpy(grown + relay->object_size, data, n);
+    relay->object_size += n;
+    return 0;
+}
+
+/*
+ * make the read buffer of relay hold size bytes, between MAXLINE and
+ * RELAY_MAX; it keeps its size if no larger buffer can be had
+ */
+static void relayGrow(relay_t *relay, long size) {
+    char *bigger;
+
+    if (size > RELAY_MAX) {
+        size = RELAY_MAX;
+    }
+    if (size <= buf_size(relay->buf) || (bigger = buf_get(size)) == NULL) {
+        return;
+    }
+    buf_put(relay->buf);
+    relay->buf = bigger;
+}
+
+/* relayResponse() through the buffers of relay */
+static void relayStream(int fd, rio_t *rio, char *uri, char *range,
+    int ranged, relay_t *relay, log_record *rec) {
+
+    char *buf = relay->buf, *hdrs, *grown, value[32];
+    size_t hdr_len = 0;
+    ssize_t buflen;
+    int status, clip = 0, chunked = 0, is_exceed = 0;
+    long start, total, first = 0, last = -1, off, body_len = -1;
+
+    /* read the status line and headers, they start the cached object */
+    while ((buflen = rio_readlineb(rio, buf, MAXLINE)) > 0) {
+        if (hdr_len + buflen > MAX_HDR ||
+            (grown = buf_grow(relay->object, hdr_len + buflen)) == NULL) {
+            rec->status = 502;
+            printerror(fd, uri, "502", "Bad Gateway",
+                "Response header from server is too large");
+            return;
+        }
+        relay->object = grown;
+        memcpy(grown + hdr_len, buf, buflen);
+        hdr_len += buflen;
+        if (!strcmp(buf, "\r\n")) {
+            break;
+        }
+    }
+    if (buflen < 0) {
+        rec->status = 504;
+        printerror(fd, uri, "504", "Gateway Timeout",
+            "No response from server in time");
+        return;
+    }
+    if (hdr_len == 0) {
+        rec->status = 502;
+        printerror(fd, uri, "502", "Bad Gateway",
+            "Empty response from server");
+        return;
+    }
+    hdrs = relay->object;
+    relay->object_size = hdr_len;
+
+    status = http_status(hdrs, hdr_len);
+    total = http_entity_length(hdrs, hdr_len, &start);
+    if (http_get_header(hdrs, hdr_len, "Content-Length", value, sizeof(value))) {
+        body_len = atol(value);
+    }
+
+    /* only send the client's part of an aligned range */
+    if (ranged && (status == 200 || status == 206) && total >= 0) {
+        if (http_parse_range(range, total, &first, &last) != 1) {
+            rec->status = 416;
+            rangeError(fd, total);
+            return;
+        }
+        clip = 1;
+        rec->status = 206;
+        buflen = rangeHdr(buf, hdrs, hdr_len, first, last, total);
+        if (rio_writen(fd, buf, buflen) < 0) {
+            return;
+        }
+        rec->bytes = buflen;
+    }
+    else {
+        rec->status = status;
+        if (rio_writen(fd, hdrs, hdr_len) < 0) {
+            return;
+        }
+        rec->bytes = hdr_len;
+    }
+
+    /* large objects are cached in chunks starting on chunk boundaries */
+    if (relay->keep && chunk_mode && (status == 200 || status == 206) &&
+        total >= 0 &&
+        hdr_len + total > MAX_OBJECT_SIZE && start % CHUNK_SIZE == 0 &&
+        (relay->chunk = buf_get(CHUNK_SIZE)) != NULL &&
+        (relay->key = buf_get(CHUNK_KEYLEN)) != NULL) {
+        chunked = 1;
+        chunkKey(relay->key, uri, -1);
+        cache_insert(cache_ptr, relay->key, hdrs, hdr_len);
+    }
+
+    /* a partial response is never cached as a whole object */
+    if (!relay->keep || status == 206 || hdr_len > MAX_OBJECT_SIZE) {
+        is_exceed = 1;
+        buf_put(relay->object);
+        relay->object = NULL;
+    }
+    hdrs = NULL;
+
+    /* relay the body, stop if the client goes away; each read takes
+     * what has arrived into a buffer sized to the Content-Length, or
+     * doubled while reads of a body of unknown length fill it */
+    relayGrow(relay, body_len);
+    buf = relay->buf;
+    off = start;
+    while ((buflen = rio_readsomeb(rio, buf, buf_size(buf))) > 0) {
+        ssize_t rc = 0;
+
+        if (!clip) {
+            rc = rio_writen(fd, buf, buflen);
+        }
+        else if (off <= last && off + buflen > first) {
+            long from = (first > off) ? first - off : 0;
+            long to = (last < off + buflen - 1) ? last - off : buflen - 1;
+            rc = rio_writen(fd, buf + from, to - from + 1);
+        }
+        if (rc < 0) {
+            return;
+        }
+        rec->bytes += rc;
+
+        /* size of the buffer exceeds the max object size
+         * discard the buffer */
+        if (!is_exceed && relayKeep(relay, buf, buflen) < 0) {
+            is_exceed = 1;
+        }
+
+        /* cut the body into chunks, the last one may be short */
+        if (chunked) {
+            ssize_t done = 0;
+            while (done < buflen && off + done < total) {
+                size_t n = CHUNK_SIZE - relay->chunk_len;
+                if (n > buflen - done) {
+                    n = buflen - done;
+                }
+                memcpy(relay->chunk + relay->chunk_len, buf + done, n);
+                relay->chunk_len += n;
+                done += n;
+
+                if (relay->chunk_len == CHUNK_SIZE || off + done == total) {
+                    chunkKey(relay->key, uri, (off + done - 1) / CHUNK_SIZE);
+                    cache_insert(cache_ptr, relay->key, relay->chunk,
+                        relay->chunk_len);
+                    relay->chunk_len = 0;
+                }
+            }
+        }
+        off += buflen;
+
+        if (body_len < 0 && buflen == buf_size(buf)) {
+            relayGrow(relay, 2 * buflen);
+            buf = relay->buf;
+        }
+    }
+
+    /* if not exceed the max object size, insert to cache
+     * a read error or timeout leaves the object incomplete */
+    if (!is_exceed && buflen == 0) {
+        cache_insert_response(cache_ptr, uri, relay->object,
+            relay->object_size);
+        if (status == 200) {
+            prefetch_scan(uri, relay->object, relay->object_size);
+        }
+    }
+}
+
+/*
+ * fetch uri into the cache for the prefetcher, unless it is cached or
+ * its host is at its limits; nothing is sent to any client
+ */
+static void prefetchFetch(char *uri) {
+    cache_block hit, *block;
+
+    /* the owner of uri prefetches it, if it has peers */
+    if (peer_owner(uri) != NULL) {
+        return;
+    }
+    if ((block = cache_match(cache_ptr, uri, &hit)) != NULL) {
+        int skip = (block->freshness != CACHE_REFRESH);
+
+        cache_release(block);
+        if (skip) {
+            return;
+        }
+    }
+    fetchObject(uri);
+}
+
+/* fetch an expired object again in the background, see cache_match() */
+void refresh(char *uri) {
+    char *copy;
+
+    pthread_once(&refresh_once, refreshInit);
+    if ((copy = strdup(uri)) != NULL &&
+        sbuf_tryinsert(&refresh_lane, copy) < 0) {
+        free(copy);
+    }
+}
+
+/* start the refresh workers */
+static void refreshInit(void) {
+    pthread_t tid;
+    int i;
+
+    sbuf_init(&refresh_lane, REFRESH_QUEUE);
+    for (i = 0; i < REFRESH_WORKERS; i++) {
+        Pthread_create(&tid, NULL, refreshWorker, NULL);
+    }
+}
+
+/* refresh worker: fetch queued URIs of expired objects for ever */
+static void *refreshWorker(void *vargp) {
+    Pthread_detach(pthread_self());
+
+    while (1) {
+        char *uri = sbuf_remove(&refresh_lane);
+        fetchObject(uri);
+        free(uri);
+    }
+    return NULL;
+}
+
+/*
+ * fetch uri from its server and cache a 200 response, nothing is sent to
+ * a client and failures are dropped
+ */
+static void fetchObject(char *uri) {
+    char host[MAXLINE], filename[MAXLINE], request_buf[MAXLINE];
+    char *object_buf;
+    size_t object_size = 0;
+    ssize_t n;
+    int port, fd_server;
+    rio_t rio;
+
+    if (parse_uri(uri, host, &port, filename) < 0 ||
+        strlen(filename) + strlen(host) + 64 > MAXLINE / 2) {
+        return;
+    }
+    if (limiter_acquire(host_limit, host) != LIMIT_OK) {
+        return;
+    }
+
+    if ((fd_server = openServer(host, port)) >= 0) {
+        setTimeouts(fd_server, idle_timeout);
+        rio_readinitb(&rio, fd_server);
+        rio_setdeadline(&rio, req_timeout ? rio_clock() + req_timeout : 0);
+
+        n = snprintf(request_buf, MAXLINE / 2, "GET %s HTTP/1.0\r\nHost: %s\r\n",
+            filename, host);
+        n += stdHdr(request_buf + n);
+        n += sprintf(request_buf + n, "\r\n");
+
+        /* read one byte more than fits to tell a too large object */
+        if (rio_writen(fd_server, request_buf, n) >= 0 &&
+            (object_buf = buf_get(MAX_OBJECT_SIZE + 1)) != NULL) {
+            while ((n = rio_readsomeb(&rio, object_buf + object_size,
+                MAX_OBJECT_SIZE + 1 - object_size)) > 0) {
+                object_size += n;
+            }
+            if (n == 0 && object_size <= MAX_OBJECT_SIZE &&
+                http_status(object_buf, object_size) == 200 &&
+                http_header_len(object_buf, object_size)) {
+                cache_insert_response(cache_ptr, uri, object_buf, object_size);
+            }
+            buf_put(object_buf);
+        }
+        rio_freeb(&rio);
+        Close(fd_server);
+    }
+    limiter_release(host_limit, host);
+}
+
+/* print command line usage and exit */
+void usage(char *prog) {
+    fprintf(stderr, "usage: %s [-zcp] [-l limits] [-L limits] [-t timeouts] [-a n] [-e engine] [-f prefetch] [-w workers] [-g logfile] [-s ttl:stale] [-m bytes] [-H pages] [-P n] [-b bufs] [-n nodelay:cork] [-r peers] [-d secs] <port>\n", prog);
+    fprintf(stderr, "  -z  compress text-like objects in the cache\n");
+    fprintf(stderr, "  -c  cache large objects in chunks for range requests\n");
+    fprintf(stderr, "  -l  rate:burst:inflight limits per client address\n");
+    fprintf(stderr, "  -L  rate:burst:inflight limits per upstream host\n");
+    fprintf(stderr, "  -t  header:connect:idle:total timeouts in seconds, 0 for none\n");
+    fprintf(stderr, "  -a  accept on n SO_REUSEPORT listeners, one thread each\n");
+    fprintf(stderr, "  -p  pin accept threads and their connections to CPUs\n");
+    fprintf(stderr, "  -e  I/O engine: thread (default), uring or coro; uring answers\n"
+        "      cache hits on the ring and hands misses to threads\n");
+    fprintf(stderr, "  -f  workers:budget prefetching resources of cached pages\n");
+    fprintf(stderr, "  -w  hit:miss worker pools serving cache hits and misses\n");
+    fprintf(stderr, "  -g  append a binary access log to logfile, see logdump\n");
+    fprintf(stderr, "  -s  ttl:stale seconds objects without max-age stay fresh, then\n"
+        "      are served stale while refreshed in the background\n");
+    fprintf(stderr, "  -m  bytes the cache may allocate (k/m/g suffix), "
+        "SIGUSR2 prints its use\n");
+    fprintf(stderr, "  -H  4k, thp or hugetlb: keep cached objects in one region of the\n"
+        "      budget backed by such pages rather than on the heap\n");
+    fprintf(stderr, "  -P  n worker processes sharing the cache in shared memory\n");
+    fprintf(stderr, "  -r  host:port,... peer proxies, this one included, sharing their\n"
+        "      caches: a miss goes to the peer owning its URI by consistent hashing\n");
+    fprintf(stderr, "  -b  rcvbuf:sndbuf bytes (k/m suffix) of server and client sockets,\n"
+        "      0 for the kernel's autotuning (default 0:0)\n");
+    fprintf(stderr, "  -n  nodelay:cork, 1 or 0: TCP_NODELAY on every socket and TCP_CORK\n"
+        "      on client sockets while a miss is relayed (default 1:1)\n");
+    fprintf(stderr, "  -d  seconds SIGTERM waits for open connections, 0 for ever "
+        "(default 30);\n      SIGHUP starts the binary anew on the same "
+        "sockets and cache, then drains\n");
+    exit(1);
+}
+
 /* 
  * get host, port, filename from the uri
  * http://<host>:<port><filename>
@@ -280,10 +2392,10 @@ void printerror(int fd, char *cause, char *errnum,
 
     /* Print the HTTP response */
     sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
+    rio_writen(fd, buf, strlen(buf));
     sprintf(buf, "Content-type: text/html\r\n");
-    Rio_writen(fd, buf, strlen(buf));
+    rio_writen(fd, buf, strlen(buf));
     sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-    Rio_writen(fd, buf, strlen(buf));
-    Rio_writen(fd, body, strlen(body));
+    rio_writen(fd, buf, strlen(buf));
+    rio_writen(fd, body, strlen(body));
 }
@@ -0,0 +1,76 @@
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include "csapp.h"
+#include "cache.h"
+#include "ratelimit.h"
+#include "accesslog.h"
+
+/*
+ * state of the proxy shared with the front ends that accept and serve
+ * client connections besides the thread per connection loop
+ */
+
+/* Global pointer to cache base */
+extern cache *cache_ptr;
+
+/* admission limits per client address and per upstream host */
+extern limiter *client_limit;
+extern limiter *host_limit;
+
+/* an accepted client connection handed to a thread */
+typedef struct {
+    int fd;
+    char client[INET_ADDRSTRLEN];
+    char *pre;                  //request bytes already read from fd, in a
+                                //pooled buffer, or NULL
+    size_t prelen;              //at most RIO_BUFSIZE
+    log_record rec;             //the request, logged when conn is released
+} conn_t;
+
+/* a zeroed connection on fd from the buffer pool, NULL if out of memory */
+conn_t *conn_alloc(int fd);
+
+/* give a connection and its request bytes back to the pool */
+void conn_free(conn_t *conn);
+
+/*
+ * check a new connection from client against the client limits
+ * return 0 if admitted, otherwise answer the refusal, close fd and
+ * return -1; an admitted connection is released by doit() or by the
+ * caller with limiter_release(client_limit, client)
+ */
+int admit(int fd, char *client);
+
+/*
+ * serve an admitted connection on a new thread with attributes attr
+ * (NULL for the defaults), or queue it for the hit workers of -w if it
+ * is a GET whose request headers are all in conn->pre; the proxy owns
+ * conn from here on and frees it
+ * return -1 if conn could not be taken, it is closed and freed
+ */
+int dispatch(conn_t *conn, pthread_attr_t *attr);
+
+/*
+ * fetch an expired object again on a background worker and swap it into
+ * the cache, for the caller cache_match() gave CACHE_REFRESH; dropped if
+ * too many refreshes are waiting already
+ */
+void refresh(char *uri);
+
+/*
+ * set when the process drains, on SIGTERM or once a new image took over
+ * the listening sockets on SIGHUP: front ends stop accepting and
+ * unlisten(), and the process exits when live_conns, every conn_t and
+ * every connection a front end holds itself, drops to 0
+ * drain_fd is an eventfd turning readable at the same time, for front
+ * ends sleeping in epoll_wait()
+ */
+extern int draining;
+extern int drain_fd;
+extern long live_conns;
+
+/* close listenfd, a front end will not accept on it any more */
+void unlisten(int listenfd);
+
+#endif
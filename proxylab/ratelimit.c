@@ -0,0 +1,157 @@
+#include <time.h>
+#include "csapp.h"
+#include "ratelimit.h"
+
+#define LIMIT_SLOTS 4096
+#define LIMIT_STRIPES 64
+
+/* a token bucket and in-flight counter for one key */
+typedef struct bucket {
+    unsigned long key;          //hash of the key owning the bucket, 0 if free
+    double tokens;
+    double last;                //time of the last refill in seconds
+    int inflight;
+} bucket;
+
+struct limiter {
+    double rate;
+    double burst;
+    int max_inflight;
+    bucket slots[LIMIT_SLOTS];
+    sem_t stripe[LIMIT_STRIPES];
+};
+
+/* hash of key, never 0 */
+static unsigned long limit_hash(const char *key) {
+    unsigned long h = fnv1a_hash(key);
+
+    return h ? h : 1;
+}
+
+/* monotonic time in seconds */
+static double limit_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* create a limiter */
+limiter *limiter_init(double rate, double burst, int max_inflight) {
+    limiter *l = calloc(1, sizeof(limiter));
+    int i;
+
+    if (l == NULL) {
+        return NULL;
+    }
+    l->rate = rate;
+    l->burst = (burst > 0) ? burst : rate;
+    l->max_inflight = max_inflight;
+    for (i = 0; i < LIMIT_STRIPES; i++) {
+        Sem_init(&l->stripe[i], 0, 1);
+    }
+    return l;
+}
+
+/* parse "rate:burst:inflight" into a new limiter */
+limiter *limiter_parse(char *spec) {
+    double rate = 0, burst = 0;
+    int max_inflight = 0;
+    char *p = spec, *end;
+
+    rate = strtod(p, &end);
+    if (end == p || rate < 0) {
+        return NULL;
+    }
+    if (*end == ':') {
+        p = end + 1;
+        burst = strtod(p, &end);
+        if (burst < 0) {
+            return NULL;
+        }
+        if (*end == ':') {
+            p = end + 1;
+            max_inflight = strtol(p, &end, 10);
+            if (end == p || max_inflight < 0) {
+                return NULL;
+            }
+        }
+    }
+    if (*end != '\0') {
+        return NULL;
+    }
+    return limiter_init(rate, burst, max_inflight);
+}
+
+/* admit one request for key */
+int limiter_acquire(limiter *l, const char *key) {
+    unsigned long h;
+    bucket *b;
+    sem_t *lock;
+    double now;
+    int rc = LIMIT_OK;
+
+    if (l == NULL) {
+        return LIMIT_OK;
+    }
+
+    h = limit_hash(key);
+    b = &l->slots[h % LIMIT_SLOTS];
+    lock = &l->stripe[h % LIMIT_STRIPES];
+    now = limit_now();
+
+    P(lock);
+
+    /* refill the bucket for the time passed since the last request */
+    if (b->key != 0) {
+        b->tokens += (now - b->last) * l->rate;
+        if (b->tokens > l->burst) {
+            b->tokens = l->burst;
+        }
+    }
+    b->last = now;
+
+    /* a free or idle bucket is taken over by the new key */
+    if (b->key != h && (b->key == 0 ||
+        (b->inflight == 0 && (l->rate <= 0 || b->tokens >= l->burst)))) {
+        b->key = h;
+        b->tokens = l->burst;
+    }
+
+    if (l->max_inflight > 0 && b->inflight >= l->max_inflight) {
+        rc = LIMIT_BUSY;
+    }
+    else if (l->rate > 0 && b->tokens < 1) {
+        rc = LIMIT_RATE;
+    }
+    else {
+        if (l->rate > 0) {
+            b->tokens -= 1;
+        }
+        b->inflight++;
+    }
+
+    V(lock);
+    return rc;
+}
+
+/* finish a request admitted by limiter_acquire() */
+void limiter_release(limiter *l, const char *key) {
+    unsigned long h;
+    bucket *b;
+    sem_t *lock;
+
+    if (l == NULL) {
+        return;
+    }
+
+    h = limit_hash(key);
+    b = &l->slots[h % LIMIT_SLOTS];
+    lock = &l->stripe[h % LIMIT_STRIPES];
+
+    P(lock);
+    if (b->inflight > 0) {
+        b->inflight--;
+    }
+    V(lock);
+}
@@ -0,0 +1,45 @@
+#ifndef __RATELIMIT_H__
+#define __RATELIMIT_H__
+
+/*
+ * token bucket rate limits and in-flight caps keyed by a string
+ * (a client address or an upstream host)
+ *
+ * Keys hash into a fixed table of buckets and each group of buckets
+ * shares one semaphore, so an admission check is O(1) and only
+ * contends with checks for keys in the same stripe. Two keys that
+ * land in the same bucket while both are busy share its limits.
+ */
+
+typedef struct limiter limiter;
+
+/* return codes of limiter_acquire() */
+#define LIMIT_OK 0
+#define LIMIT_RATE -1           //no token left in the bucket
+#define LIMIT_BUSY -2           //too many requests in flight
+
+/*
+ * create a limiter allowing rate requests per second with bursts of
+ * up to burst requests, and at most max_inflight concurrent requests
+ * per key; 0 disables the corresponding limit
+ */
+limiter *limiter_init(double rate, double burst, int max_inflight);
+
+/*
+ * parse a "rate:burst:inflight" option into a new limiter
+ * missing fields are 0 (burst defaults to rate)
+ * return NULL if spec is malformed
+ */
+limiter *limiter_parse(char *spec);
+
+/*
+ * admit one request for key
+ * return LIMIT_OK and count it as in flight, or the reason for refusal
+ * a NULL limiter admits everything
+ */
+int limiter_acquire(limiter *l, const char *key);
+
+/* finish a request admitted by limiter_acquire() */
+void limiter_release(limiter *l, const char *key);
+
+#endif
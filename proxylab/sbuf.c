@@ -0,0 +1,74 @@
+#include "csapp.h"
+#include "sbuf.h"
+
+/* create an empty, bounded, shared FIFO buffer with n slots */
+void sbuf_init(sbuf_t *sp, int n) {
+    size_t size = 2;
+
+    while (size < n) {
+        size <<= 1;                 //the queue takes a power of 2
+    }
+    if (mpmc_init(&sp->q, size) < 0) {
+        unix_error("sbuf_init error");
+    }
+    Sem_init(&sp->slots, 0, n);     //initially, buf has n empty slots
+    Sem_init(&sp->items, 0, 0);     //initially, buf has zero items
+}
+
+/* clean up buffer sp */
+void sbuf_deinit(sbuf_t *sp) {
+    mpmc_deinit(&sp->q);
+}
+
+/*
+ * put item into the queue of sp once a slot has been taken for it
+ * the slot may still be in the hands of a remover for a moment
+ */
+static void sbuf_push(sbuf_t *sp, void *item) {
+    while (mpmc_push(&sp->q, item) < 0) {
+        sched_yield();
+    }
+    V(&sp->items);                          //announce available item
+}
+
+/* insert item onto the rear of shared buffer sp */
+void sbuf_insert(sbuf_t *sp, void *item) {
+    P(&sp->slots);                          //wait for available slot
+    sbuf_push(sp, item);
+}
+
+/* insert item unless sp is full */
+int sbuf_tryinsert(sbuf_t *sp, void *item) {
+    while (sem_trywait(&sp->slots) < 0) {
+        if (errno != EINTR) {
+            return -1;                      //no slot available
+        }
+    }
+    sbuf_push(sp, item);
+    return 0;
+}
+
+/* insert as many of the n items as there are slots for */
+int sbuf_tryinsertn(sbuf_t *sp, void **items, int n) {
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (sbuf_tryinsert(sp, items[i]) < 0) {
+            break;
+        }
+    }
+    return i;
+}
+
+/* remove and return the first item from buffer sp */
+void *sbuf_remove(sbuf_t *sp) {
+    void *item;
+
+    P(&sp->items);                          //wait for available item
+    /* counted items may still be on their way in for a moment */
+    while (mpmc_pop(&sp->q, &item) < 0) {
+        sched_yield();
+    }
+    V(&sp->slots);                          //announce available slot
+    return item;
+}
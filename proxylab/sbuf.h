@@ -0,0 +1,39 @@
+#ifndef __SBUF_H__
+#define __SBUF_H__
+
+#include "csapp.h"
+
+/*
+ * bounded FIFO of pointers shared by producer and consumer threads
+ * (the sbuf package of CS:APP 12.5), the items pass through a lock-free
+ * queue and the semaphores only count slots and items for the threads
+ * that wait for them
+ */
+typedef struct {
+    mpmc_t q;           //the items
+    sem_t slots;        //counts available slots
+    sem_t items;        //counts available items
+} sbuf_t;
+
+/* create an empty, bounded, shared FIFO buffer with n slots */
+void sbuf_init(sbuf_t *sp, int n);
+
+/* clean up buffer sp */
+void sbuf_deinit(sbuf_t *sp);
+
+/* insert item onto the rear of shared buffer sp, waiting for a slot */
+void sbuf_insert(sbuf_t *sp, void *item);
+
+/* insert item unless sp is full, return -1 if it was not inserted */
+int sbuf_tryinsert(sbuf_t *sp, void *item);
+
+/*
+ * insert the first n of items, as many as there are slots for
+ * return the number inserted
+ */
+int sbuf_tryinsertn(sbuf_t *sp, void **items, int n);
+
+/* remove and return the first item from buffer sp, waiting for one */
+void *sbuf_remove(sbuf_t *sp);
+
+#endif
@@ -0,0 +1,293 @@
+#include <sys/epoll.h>
+#include "csapp.h"
+#include "tunnel.h"
+#include "accesslog.h"
+
+#define TUNNEL_EVENTS 64
+#define TUNNEL_SPLICE (1 << 16)
+#define TUNNEL_SWEEP 1000       //ms between checks for idle tunnels
+
+struct tunnel;
+
+/* one socket of a tunnel, registered with epoll */
+typedef struct tunnel_end {
+    struct tunnel *t;
+    unsigned int events;        //events currently registered
+} tunnel_end;
+
+/*
+ * a CONNECT tunnel
+ * direction d moves bytes read from fd[d] to fd[1 - d] through pipe[d]
+ */
+typedef struct tunnel {
+    int fd[2];
+    int pipe[2][2];
+    size_t pending[2];          //bytes sitting in pipe[d]
+    long bytes[2];              //bytes delivered in direction d
+    int eof[2];                 //fd[d] has no more data to read
+    int shut[2];                //write side of fd[1 - d] was shut down
+    int dead;
+    long last;                  //rio_clock() time bytes last moved
+    tunnel_end end[2];
+    struct tunnel *prev, *next; //list of live tunnels
+    struct tunnel *next_dead;
+    log_record rec;             //of the CONNECT, written once closed
+} tunnel;
+
+static int epfd = -1;
+static int addfd[2];            //new tunnels are passed to the relay here
+static int idle_limit;          //ms a tunnel may stay silent, 0 for ever
+static tunnel live;             //dummy head of the live tunnel list
+
+static void *tunnel_thread(void *vargp);
+
+/* start the relay thread */
+void tunnel_init(int idle) {
+    struct epoll_event ev;
+    pthread_t tid;
+
+    idle_limit = idle;
+    live.prev = live.next = &live;
+
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+        pipe2(addfd, O_CLOEXEC) < 0) {
+        unix_error("tunnel_init error");
+    }
+
+    /* the add pipe is the only end without a tunnel */
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, addfd[0], &ev) < 0) {
+        unix_error("tunnel_init error");
+    }
+    Pthread_create(&tid, NULL, tunnel_thread, NULL);
+}
+
+/* set up a tunnel and pass it to the relay thread */
+int tunnel_add(int client_fd, int server_fd, log_record *rec) {
+    tunnel *t = calloc(1, sizeof(tunnel));
+    int i;
+
+    if (t == NULL) {
+        return -1;
+    }
+    if (pipe2(t->pipe[0], O_NONBLOCK | O_CLOEXEC) < 0) {
+        free(t);
+        return -1;
+    }
+    if (pipe2(t->pipe[1], O_NONBLOCK | O_CLOEXEC) < 0) {
+        close(t->pipe[0][0]);
+        close(t->pipe[0][1]);
+        free(t);
+        return -1;
+    }
+
+    t->fd[0] = client_fd;
+    t->fd[1] = server_fd;
+    t->rec = *rec;
+
+    for (i = 0; i < 2; i++) {
+        fcntl(t->fd[i], F_SETFL, fcntl(t->fd[i], F_GETFL) | O_NONBLOCK);
+        t->end[i].t = t;
+        t->end[i].events = EPOLLIN;
+    }
+
+    /* a pointer is written atomically, from here on only the relay
+     * thread touches t */
+    if (write(addfd[1], &t, sizeof(t)) != sizeof(t)) {
+        for (i = 0; i < 2; i++) {
+            close(t->pipe[i][0]);
+            close(t->pipe[i][1]);
+        }
+        free(t);
+        return -1;
+    }
+    return 0;
+}
+
+/* register the sockets of a new tunnel, return -1 on failure */
+static int tunnel_register(tunnel *t) {
+    struct epoll_event ev;
+    int i;
+
+    /* link first, tunnel_close() unlinks */
+    t->last = rio_clock();
+    t->next = live.next;
+    t->prev = &live;
+    live.next->prev = t;
+    live.next = t;
+
+    for (i = 0; i < 2; i++) {
+        ev.events = t->end[i].events;
+        ev.data.ptr = &t->end[i];
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, t->fd[i], &ev) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * move as many bytes as possible in direction d without blocking
+ * return -1 if the tunnel failed
+ */
+static int tunnel_pump(tunnel *t, int d) {
+    ssize_t n;
+
+    while (1) {
+        /* drain the pipe into the destination first */
+        if (t->pending[d] > 0) {
+            n = splice(t->pipe[d][0], NULL, t->fd[1 - d], NULL, t->pending[d],
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0) {
+                return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+            }
+            t->pending[d] -= n;
+            t->bytes[d] += n;
+            t->last = rio_clock();
+            continue;
+        }
+
+        /* pass the end of stream on once everything is delivered */
+        if (t->eof[d]) {
+            if (!t->shut[d]) {
+                shutdown(t->fd[1 - d], SHUT_WR);
+                t->shut[d] = 1;
+            }
+            return 0;
+        }
+
+        n = splice(t->fd[d], NULL, t->pipe[d][1], NULL, TUNNEL_SPLICE,
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0) {
+            return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+        }
+        if (n == 0) {
+            t->eof[d] = 1;
+        }
+        t->pending[d] += n;
+    }
+}
+
+/* watch each socket for what the tunnel is currently waiting on */
+static void tunnel_watch(tunnel *t) {
+    struct epoll_event ev;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        unsigned int events = 0;
+        if (!t->eof[i] && t->pending[i] == 0) {
+            events |= EPOLLIN;
+        }
+        if (t->pending[1 - i] > 0) {
+            events |= EPOLLOUT;
+        }
+        if (events != t->end[i].events) {
+            ev.events = events;
+            ev.data.ptr = &t->end[i];
+            epoll_ctl(epfd, EPOLL_CTL_MOD, t->fd[i], &ev);
+            t->end[i].events = events;
+        }
+    }
+}
+
+/* close a finished tunnel and log the bytes relayed to the client */
+static void tunnel_close(tunnel *t) {
+    int i;
+
+    t->rec.bytes += t->bytes[1];
+    t->rec.latency = accesslog_now() - t->rec.time;
+    accesslog_write(&t->rec);
+
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+
+    for (i = 0; i < 2; i++) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, t->fd[i], NULL);
+        close(t->fd[i]);
+        close(t->pipe[i][0]);
+        close(t->pipe[i][1]);
+    }
+}
+
+/* relay loop: pump every tunnel that has a socket ready */
+static void *tunnel_thread(void *vargp) {
+    struct epoll_event events[TUNNEL_EVENTS];
+    long last_sweep = rio_clock();
+    int i, n;
+
+    Pthread_detach(pthread_self());
+
+    while (1) {
+        tunnel *dead = NULL;
+
+        n = epoll_wait(epfd, events, TUNNEL_EVENTS,
+            idle_limit ? TUNNEL_SWEEP : -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            unix_error("tunnel epoll_wait error");
+        }
+
+        for (i = 0; i < n; i++) {
+            tunnel *t;
+
+            if (events[i].data.ptr == NULL) {
+                /* a new tunnel from tunnel_add() */
+                if (read(addfd[0], &t, sizeof(t)) != sizeof(t)) {
+                    continue;
+                }
+                if (tunnel_register(t) < 0) {
+                    tunnel_close(t);
+                    t->next_dead = dead;
+                    dead = t;
+                }
+                continue;
+            }
+
+            t = ((tunnel_end *)events[i].data.ptr)->t;
+
+            /* the other socket of this tunnel may have failed already */
+            if (t->dead) {
+                continue;
+            }
+
+            if (tunnel_pump(t, 0) < 0 || tunnel_pump(t, 1) < 0 ||
+                (t->shut[0] && t->shut[1])) {
+                tunnel_close(t);
+                t->dead = 1;
+                t->next_dead = dead;
+                dead = t;
+            }
+            else {
+                tunnel_watch(t);
+            }
+        }
+
+        /* close tunnels that moved nothing for idle_limit */
+        if (idle_limit && rio_clock() - last_sweep >= TUNNEL_SWEEP) {
+            long now = rio_clock();
+            tunnel *t, *next;
+
+            for (t = live.next; t != &live; t = next) {
+                next = t->next;
+                if (!t->dead && now - t->last > idle_limit) {
+                    tunnel_close(t);
+                    t->dead = 1;
+                    t->next_dead = dead;
+                    dead = t;
+                }
+            }
+            last_sweep = now;
+        }
+
+        /* free only after the batch, later events may point at them */
+        while (dead != NULL) {
+            tunnel *next = dead->next_dead;
+            free(dead);
+            dead = next;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,32 @@
+#ifndef __TUNNEL_H__
+#define __TUNNEL_H__
+
+#include "accesslog.h"
+
+/*
+ * CONNECT tunnels relayed by one event driven thread
+ *
+ * Both sockets of a tunnel are switched to non-blocking mode and
+ * watched with epoll. Bytes move between them through a pipe per
+ * direction with splice(), so they are never copied to user space and
+ * no thread blocks on any single tunnel.
+ */
+
+/*
+ * start the relay thread, call once before tunnel_add()
+ * tunnels that move no bytes for idle milliseconds are closed,
+ * 0 keeps them open for ever
+ */
+void tunnel_init(int idle);
+
+/*
+ * hand a connected client/server socket pair to the relay thread
+ * the relay owns both descriptors from now on and closes them when the
+ * tunnel is done, then logs a copy of rec with the bytes relayed to the
+ * client added to rec->bytes and the latency up to the close
+ * return 0 on success, -1 if the tunnel could not be set up (the
+ * descriptors and rec are left to the caller)
+ */
+int tunnel_add(int client_fd, int server_fd, log_record *rec);
+
+#endif
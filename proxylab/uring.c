@@ -0,0 +1,576 @@
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "csapp.h"
+#include "http.h"
+#include "proxy.h"
+#include "uring.h"
+#include "bufpool.h"
+
+#define URING_ENTRIES 256
+#define URING_BUFS 256          //recv buffers provided to the kernel
+#define URING_BUFSIZE 4096
+#define URING_GROUP 1           //buffer group of the recv buffers
+#define URING_SWEEP 1000        //ms between checks for stalled clients
+
+/* the kind of operation a completion belongs to, in the low bits of
+ * its user_data; the other bits point at the connection, if any */
+#define OP_ACCEPT 1
+#define OP_RECV 2
+#define OP_SEND 3
+#define OP_CLOSE 4
+#define OP_CANCEL 5
+#define OP_PROVIDE 6
+#define OP_TICK 7
+#define OP_MASK 7
+
+/* states of a connection owned by the loop */
+#define UC_RECV 0               //multishot recv collecting the headers
+#define UC_CANCEL 1             //recv being cancelled, then answer or hand over
+#define UC_EXPIRE 2             //recv being cancelled, then close
+#define UC_SEND 3               //sending a cached response
+#define UC_CLOSE 4              //close queued
+
+/* the mapped submission and completion queues */
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_array, sq_mask, sq_entries;
+    unsigned sq_local;          //tail including sqes not yet published
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, cq_mask;
+    struct io_uring_cqe *cqes;
+} ring_t;
+
+/* a client connection owned by the loop */
+typedef struct ucon {
+    int fd;
+    int state;
+    int overflow;               //request bytes did not fit into buf
+    long last;                  //rio_clock() time of the accept or last send
+    char client[INET_ADDRSTRLEN];
+    char *buf;                  //request bytes received so far, in a
+                                //pooled buffer grown up to RIO_BUFSIZE
+    size_t len;
+    struct iovec out[3];        //response being sent, out of hit and age
+    struct msghdr msg;          //the part of out left to send
+    char age[HTTP_AGE_WIDTH];   //see cache_response()
+    size_t out_len, sent;
+    cache_block hit;            //pinned while out points into it
+    int pinned;
+    char *decoded;              //pooled buffer a compressed hit is
+                                //decoded into, or NULL
+    log_record rec;             //the request answered from the ring
+    struct ucon *prev, *next;
+} ucon;
+
+/* one event loop */
+typedef struct {
+    ring_t ring;
+    int listenfd;
+    int stopped;                //the accept is cancelled, the proxy drains
+    int hdr_ms, idle_ms;
+    pthread_attr_t *attr;
+    char *bufs;                 //URING_BUFS * URING_BUFSIZE bytes
+    struct __kernel_timespec tick;
+    ucon live;                  //dummy head of the connections
+} engine_t;
+
+/* totals of every loop, printed on SIGUSR1 */
+static long uring_enters;
+static long uring_requests;
+static volatile sig_atomic_t uring_report;
+
+static void uring_usr1(int sig) {
+    uring_report = 1;
+}
+
+/* map the rings of a new io_uring instance, return -1 on failure */
+static int ring_init(ring_t *r, unsigned entries) {
+    struct io_uring_params p;
+    size_t sq_len, cq_len;
+    char *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    if ((r->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0) {
+        return -1;
+    }
+
+    sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && cq_len > sq_len) {
+        sq_len = cq_len;
+    }
+
+    sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        close(r->fd);
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq = sq;
+    }
+    else {
+        cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            munmap(sq, sq_len);
+            close(r->fd);
+            return -1;
+        }
+    }
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+        IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        if (cq != sq) {
+            munmap(cq, cq_len);
+        }
+        munmap(sq, sq_len);
+        close(r->fd);
+        return -1;
+    }
+
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->sq_local = *r->sq_tail;
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+/*
+ * submit the queued sqes and wait for at least wait completions
+ * return -1 with errno set if io_uring_enter() failed
+ */
+static int ring_enter(ring_t *r, unsigned wait) {
+    unsigned tail = *r->sq_tail;
+    unsigned n = r->sq_local - tail;
+    int rc;
+
+    __atomic_store_n(r->sq_tail, r->sq_local, __ATOMIC_RELEASE);
+    rc = syscall(__NR_io_uring_enter, r->fd, n, wait,
+        wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    __atomic_fetch_add(&uring_enters, 1, __ATOMIC_RELAXED);
+    return (rc < 0) ? -1 : 0;
+}
+
+/* return a cleared sqe, submitting the queued ones if the ring is full */
+static struct io_uring_sqe *ring_sqe(ring_t *r) {
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    while (r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >=
+        r->sq_entries) {
+        ring_enter(r, 0);
+    }
+    idx = r->sq_local & r->sq_mask;
+    sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    r->sq_local++;
+    return sqe;
+}
+
+/* queue an operation of kind op for connection c */
+static struct io_uring_sqe *uring_op(engine_t *e, int opcode, ucon *c, int op) {
+    struct io_uring_sqe *sqe = ring_sqe(&e->ring);
+
+    sqe->opcode = opcode;
+    sqe->user_data = (unsigned long)c | op;
+    return sqe;
+}
+
+/* give n recv buffers starting at bid (back) to the kernel */
+static void uring_provide(engine_t *e, int bid, int n) {
+    struct io_uring_sqe *sqe = uring_op(e, IORING_OP_PROVIDE_BUFFERS, NULL, OP_PROVIDE);
+
+    sqe->fd = n;
+    sqe->addr = (unsigned long)(e->bufs + bid * URING_BUFSIZE);
+    sqe->len = URING_BUFSIZE;
+    sqe->off = bid;
+    sqe->buf_group = URING_GROUP;
+}
+
+/* accept connections until the kernel ends the multishot accept */
+static void uring_accept(engine_t *e) {
+    struct io_uring_sqe *sqe = uring_op(e, IORING_OP_ACCEPT, NULL, OP_ACCEPT);
+
+    sqe->fd = e->listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+/* read from c into provided buffers until cancelled */
+static void uring_recv(engine_t *e, ucon *c) {
+    struct io_uring_sqe *sqe = uring_op(e, IORING_OP_RECV, c, OP_RECV);
+
+    sqe->fd = c->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_GROUP;
+}
+
+/* cancel the pending operation of kind op on c */
+static void uring_cancel(engine_t *e, ucon *c, int op) {
+    struct io_uring_sqe *sqe = uring_op(e, IORING_OP_ASYNC_CANCEL, c, OP_CANCEL);
+
+    sqe->addr = (unsigned long)c | op;
+}
+
+/* send the rest of c's response */
+static void uring_send(engine_t *e, ucon *c) {
+    struct io_uring_sqe *sqe = uring_op(e, IORING_OP_SENDMSG, c, OP_SEND);
+
+    sqe->fd = c->fd;
+    sqe->addr = (unsigned long)&c->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+}
+
+/* close c, it is freed when the close completes */
+static void uring_close(engine_t *e, ucon *c) {
+    struct io_uring_sqe *sqe = uring_op(e, IORING_OP_CLOSE, c, OP_CLOSE);
+
+    sqe->fd = c->fd;
+    c->state = UC_CLOSE;
+}
+
+/* wake up after URING_SWEEP to look for stalled clients */
+static void uring_tick(engine_t *e) {
+    struct io_uring_sqe *sqe = uring_op(e, IORING_OP_TIMEOUT, NULL, OP_TICK);
+
+    e->tick.tv_sec = URING_SWEEP / 1000;
+    e->tick.tv_nsec = (URING_SWEEP % 1000) * 1000000L;
+    sqe->addr = (unsigned long)&e->tick;
+    sqe->len = 1;
+}
+
+/* unlink and free a connection the loop is done with */
+static void uring_free(ucon *c) {
+    c->prev->next = c->next;
+    c->next->prev = c->prev;
+    buf_put(c->buf);
+    buf_put(c->decoded);
+    if (c->pinned) {
+        cache_release(&c->hit);
+    }
+    free(c);
+    __atomic_fetch_sub(&live_conns, 1, __ATOMIC_RELAXED);
+}
+
+/* take a new connection, return -1 if it was turned away */
+static int uring_open(engine_t *e, int fd) {
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    ucon *c;
+
+    if ((c = calloc(1, sizeof(ucon))) == NULL) {
+        close(fd);
+        return -1;
+    }
+    c->fd = fd;
+    if (getpeername(fd, (SA *)&addr, &addrlen) == 0) {
+        inet_ntop(AF_INET, &addr.sin_addr, c->client, INET_ADDRSTRLEN);
+    }
+    if (admit(fd, c->client) < 0) {
+        free(c);
+        return -1;
+    }
+
+    __atomic_fetch_add(&live_conns, 1, __ATOMIC_RELAXED);
+    c->state = UC_RECV;
+    c->last = rio_clock();
+    c->rec.time = accesslog_now();
+    c->next = e->live.next;
+    c->prev = &e->live;
+    e->live.next->prev = c;
+    e->live.next = c;
+    uring_recv(e, c);
+    return 0;
+}
+
+/*
+ * take a response for c from the cached object pinned in c->hit
+ * return 1 if c->out points to it, the object stays pinned until c is
+ * freed, so it is sent in place even if the cache drops it meanwhile
+ */
+static int uring_respond(ucon *c) {
+    char *object;
+
+    if (c->hit.compressed &&
+        (c->decoded = buf_get(MAX_OBJECT_SIZE)) == NULL) {
+        return 0;
+    }
+    if ((object = cache_object(&c->hit, c->decoded, &c->out_len)) == NULL) {
+        return 0;
+    }
+    c->msg.msg_iov = c->out;
+    c->msg.msg_iovlen = cache_response(&c->hit, object, c->out_len, c->out,
+        c->age);
+    c->sent = 0;
+    return 1;
+}
+
+/* pass c and the bytes read from it, buffer and all, to a thread */
+static void uring_handoff(engine_t *e, ucon *c) {
+    conn_t *conn = conn_alloc(c->fd);
+
+    if (conn == NULL) {
+        limiter_release(client_limit, c->client);
+        uring_close(e, c);
+        return;
+    }
+    strcpy(conn->client, c->client);
+    conn->pre = c->buf;
+    conn->prelen = c->len;
+    c->buf = NULL;
+
+    uring_free(c);
+    dispatch(conn, e->attr);
+}
+
+/*
+ * the request of c has been read: answer a GET for a whole cached
+ * object from the ring, hand anything else over to a thread
+ */
+static void uring_request(engine_t *e, ucon *c) {
+    char method[MAXLINE], uri[MAXLINE], version[MAXLINE], value[MAXLINE];
+    size_t hdr_len = http_header_len(c->buf, c->len);
+    char *eol;
+
+    __atomic_fetch_add(&uring_requests, 1, __ATOMIC_RELAXED);
+
+    if (hdr_len && (eol = memchr(c->buf, '\n', hdr_len)) != NULL) {
+        *eol = '\0';
+        if (sscanf(c->buf, "%s %s %s", method, uri, version) == 3 &&
+            !strcmp(method, "GET") &&
+            !http_get_header(c->buf, hdr_len, "Range", value, MAXLINE) &&
+            cache_match(cache_ptr, uri, &c->hit) != NULL) {
+            c->pinned = 1;
+            if (c->hit.freshness == CACHE_REFRESH) {
+                refresh(uri);
+            }
+            if (uring_respond(c)) {
+                c->rec.uri_hash = fnv1a_hash(uri);
+                c->rec.status = http_status(c->out[0].iov_base,
+                    c->out[0].iov_len);
+                c->rec.source = LOG_HIT;
+                inet_pton(AF_INET, c->client, &c->rec.client);
+                c->state = UC_SEND;
+                c->last = rio_clock();
+                uring_send(e, c);
+                return;
+            }
+        }
+        *eol = '\n';
+    }
+    uring_handoff(e, c);
+}
+
+/* a recv completion for c */
+static void uring_recvd(engine_t *e, ucon *c, struct io_uring_cqe *cqe) {
+    int more = cqe->flags & IORING_CQE_F_MORE;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+        if (cqe->res > 0) {
+            char *grown = NULL;
+
+            if (c->len + cqe->res <= RIO_BUFSIZE) {
+                grown = buf_grow(c->buf, c->len + cqe->res);
+            }
+            if (grown == NULL) {
+                c->overflow = 1;
+            }
+            else {
+                c->buf = grown;
+                memcpy(c->buf + c->len, e->bufs + bid * URING_BUFSIZE, cqe->res);
+                c->len += cqe->res;
+            }
+        }
+        uring_provide(e, bid, 1);
+    }
+
+    if (c->state == UC_RECV) {
+        if (cqe->res <= 0 && cqe->res != -ENOBUFS) {
+            /* the client went away or failed before sending a request */
+            limiter_release(client_limit, c->client);
+            uring_close(e, c);
+            return;
+        }
+        if (http_header_len(c->buf, c->len) || c->len == RIO_BUFSIZE ||
+            c->overflow) {
+            c->state = UC_CANCEL;
+        }
+        else if (!more) {
+            /* e.g. out of buffers, read on */
+            uring_recv(e, c);
+            return;
+        }
+        else {
+            return;
+        }
+        if (more) {
+            uring_cancel(e, c, OP_RECV);
+            return;
+        }
+    }
+    else if (more) {
+        /* bytes that arrived while the recv is cancelled */
+        return;
+    }
+
+    /* the recv is over, nothing else can touch c->buf */
+    if (c->state == UC_EXPIRE || c->overflow) {
+        limiter_release(client_limit, c->client);
+        uring_close(e, c);
+    }
+    else {
+        uring_request(e, c);
+    }
+}
+
+/* a send completion for c */
+static void uring_sent(engine_t *e, ucon *c, struct io_uring_cqe *cqe) {
+    if (cqe->res > 0) {
+        size_t n = cqe->res;
+
+        c->sent += n;
+        c->last = rio_clock();
+        if (c->sent < c->out_len) {
+            /* skip the pieces sent, and the part sent of the next */
+            while (n >= c->msg.msg_iov->iov_len) {
+                n -= c->msg.msg_iov->iov_len;
+                c->msg.msg_iov++;
+                c->msg.msg_iovlen--;
+            }
+            c->msg.msg_iov->iov_base = (char *)c->msg.msg_iov->iov_base + n;
+            c->msg.msg_iov->iov_len -= n;
+            uring_send(e, c);
+            return;
+        }
+    }
+    c->rec.bytes = c->sent;
+    c->rec.latency = accesslog_now() - c->rec.time;
+    accesslog_write(&c->rec);
+    limiter_release(client_limit, c->client);
+    uring_close(e, c);
+}
+
+/* cancel the operations of clients that made no progress in time */
+static void uring_sweep(engine_t *e) {
+    long now = rio_clock();
+    ucon *c;
+
+    for (c = e->live.next; c != &e->live; c = c->next) {
+        if (c->state == UC_RECV && e->hdr_ms && now - c->last > e->hdr_ms) {
+            c->state = UC_EXPIRE;
+            uring_cancel(e, c, OP_RECV);
+        }
+        else if (c->state == UC_SEND && e->idle_ms && now - c->last > e->idle_ms) {
+            /* the failed send closes the connection */
+            c->last = now;
+            uring_cancel(e, c, OP_SEND);
+        }
+    }
+}
+
+/* run one event loop on listenfd */
+int uring_serve(int listenfd, int hdr_ms, int idle_ms, pthread_attr_t *attr) {
+    struct sigaction action;
+    engine_t *e;
+
+    if ((e = calloc(1, sizeof(engine_t))) == NULL ||
+        (e->bufs = malloc(URING_BUFS * URING_BUFSIZE)) == NULL ||
+        ring_init(&e->ring, URING_ENTRIES) < 0) {
+        if (e != NULL) {
+            free(e->bufs);
+        }
+        free(e);
+        return -1;
+    }
+    e->listenfd = listenfd;
+    e->hdr_ms = hdr_ms;
+    e->idle_ms = idle_ms;
+    e->attr = attr;
+    e->live.prev = e->live.next = &e->live;
+
+    /* no SA_RESTART, the report interrupts the wait for completions */
+    action.sa_handler = uring_usr1;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = 0;
+    sigaction(SIGUSR1, &action, NULL);
+
+    uring_provide(e, 0, URING_BUFS);
+    uring_accept(e);
+    uring_tick(e);
+
+    while (1) {
+        struct io_uring_cqe *cqe;
+        unsigned head, tail;
+
+        /* submit everything queued by the last round and wait */
+        if (ring_enter(&e->ring, 1) < 0 && errno != EINTR && errno != EBUSY) {
+            unix_error("io_uring_enter error");
+        }
+
+        if (uring_report) {
+            uring_report = 0;
+            fprintf(stderr, "uring: %ld io_uring_enter calls, %ld requests, "
+                "%.2f calls per request\n", uring_enters, uring_requests,
+                uring_requests ? (double)uring_enters / uring_requests : 0.0);
+        }
+
+        head = *e->ring.cq_head;
+        tail = __atomic_load_n(e->ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            ucon *c;
+
+            cqe = &e->ring.cqes[head & e->ring.cq_mask];
+            c = (ucon *)(unsigned long)(cqe->user_data & ~(unsigned long)OP_MASK);
+
+            switch (cqe->user_data & OP_MASK) {
+            case OP_ACCEPT:
+                if (cqe->res >= 0) {
+                    uring_open(e, cqe->res);
+                }
+                if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                    if (e->stopped) {
+                        unlisten(e->listenfd);
+                    }
+                    else {
+                        uring_accept(e);
+                    }
+                }
+                break;
+            case OP_RECV:
+                uring_recvd(e, c, cqe);
+                break;
+            case OP_SEND:
+                uring_sent(e, c, cqe);
+                break;
+            case OP_CLOSE:
+                uring_free(c);
+                break;
+            case OP_TICK:
+                if (draining && !e->stopped) {
+                    /* the accept ends, see OP_ACCEPT */
+                    e->stopped = 1;
+                    uring_cancel(e, NULL, OP_ACCEPT);
+                }
+                uring_sweep(e);
+                uring_tick(e);
+                break;
+            }
+        }
+        __atomic_store_n(e->ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
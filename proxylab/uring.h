@@ -0,0 +1,37 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <pthread.h>
+
+/*
+ * io_uring front end serving cache hits
+ *
+ * One thread per listening socket owns a ring. Connections are accepted
+ * with a multishot accept and their requests read with a multishot recv
+ * into buffers provided to the kernel up front; everything the loop
+ * wants done is queued and submitted with a single io_uring_enter() per
+ * round, which also collects the completions. A GET for an object held
+ * whole in the cache is answered from the ring with send and close
+ * operations, so a hit costs no read(), write() or thread wake-ups.
+ * Every other request, with the bytes read so far, is handed to the
+ * threaded path through dispatch() (see proxy.h). Only hits live on the
+ * ring: upstream connects, relaying a miss and CONNECT tunnels are out
+ * of scope for this front end and run on the blocking and epoll paths.
+ *
+ * The ring is set up with raw system calls, no liburing needed.
+ */
+
+/*
+ * serve connections accepted on listenfd, threads for handed over
+ * connections are started with attr
+ * a client gets hdr_ms to send its request headers and idle_ms for
+ * every send to make progress, 0 for no limit
+ * when the proxy drains, the loop cancels its accept and unlisten()s
+ * at its next tick, within a second, and serves the connections it has
+ * until the process exits
+ * never returns, unless the ring cannot be set up: return -1
+ * a SIGUSR1 makes the loop print its io_uring_enter() count per request
+ */
+int uring_serve(int listenfd, int hdr_ms, int idle_ms, pthread_attr_t *attr);
+
+#endif